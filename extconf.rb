@@ -8,6 +8,23 @@ io=open("|#{ENV['IBASE']}/bin/amq_client -v")
 defines = io.readlines.grep(/^Compiled with:/).first.chomp.split(/\s+/).grep(/^-D/)
 io.close()
 $CFLAGS += " " + defines.join(" ")
+
+# Native worker pools and blocking dequeues release the interpreter lock when
+# the running Ruby supports it, and fall back to polling otherwise.
+have_func("rb_thread_call_without_gvl", "ruby/thread.h")
+
+# Timed waits on the native queues use the monotonic clock where pthreads
+# lets us pick it.
+have_func("pthread_condattr_setclock", "pthread.h")
+
+# Native dispatcher workers checksum and inflate bodies with zlib when it's
+# there; without it they can only hash.
+have_library("z", "inflate", "zlib.h") && have_header("zlib.h")
+
+# USDT probes for bpftrace, perf and SystemTap, where systemtap-sdt-dev is
+# installed.  Without it the probes compile away.
+have_header("sys/sdt.h")
+
 create_makefile("rwire")
 
 
@@ -0,0 +1,411 @@
+# Copyright (c) 2009, Chris Wong <chris@chriswongstudio.com> All rights
+# reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# * Redistributions of source code must retain the above copyright notice,
+#   this list of conditions and the following disclaimer.
+# * Redistributions in binary form must reproduce the above copyright notice,
+#   this list of conditions and the following disclaimer in the documentation
+#   and/or other materials provided with the distribution.
+# * Neither the name of Chris Wong Studio nor the names of its contributors
+#   may be used to endorse or promote products derived from this software
+#   without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+# LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+# INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+# CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+# POSSIBILITY OF SUCH DAMAGE.
+
+
+require 'rwire'
+
+module RWire
+  # An in-process stand-in for the broker, for when producers and consumers
+  # of a queue live in the same process, and for running without a broker in
+  # tests and benchmarks.  Loopback::Connection and Loopback::Session answer
+  # to the same methods as RWire::Connection and RWire::Session, so AMQ
+  # picks them with :host => :loopback.
+  #
+  # Published contents are handed to the consumers through RWire::LocalQueue.
+  # Every queue a content is routed to links the same content, which gets the
+  # exchange and routing key it was published to as it's consumed; it's only
+  # copied if it was routed elsewhere before.  Consumers share contents with
+  # each other and with the publisher, so they should not change them.
+  # Direct, topic and fanout exchanges are supported, as are mandatory and
+  # immediate publishes.
+  # Messages are not persisted and acknowledgements are not needed.
+  #
+  # Prepared publishers (RWire::Publisher) and AMQ::Dispatcher drive the
+  # WireAPI session directly, so they need a broker session.
+  module Loopback
+    # The exchanges, queues and bindings of the process
+    class Broker
+      Queue = Struct.new(:name, :backlog, :consumers, :exclusive, :auto_delete, :next)
+
+      def self.instance
+        @instance ||= Broker.new
+      end
+
+      def initialize
+        @lock      = Mutex.new
+        @exchanges = {}   # name => type
+        @bindings  = {}   # exchange => [[routing key, queue name]]
+        @queues    = {}   # name => Queue
+        @serial    = 0
+        ["direct", "topic", "fanout"].each do |type|
+          @exchanges["amq.#{type}"] = type
+          @bindings["amq.#{type}"]  = []
+        end
+      end
+
+      # A process wide unique number, for naming queues and consumers
+      def next_serial
+        @lock.synchronize { @serial += 1 }
+      end
+
+      def declare_exchange(name, type, passive)
+        @lock.synchronize do
+          if passive || @exchanges.has_key?(name)
+            raise AMQError.new("No such exchange: #{name}") unless @exchanges.has_key?(name)
+            if !passive && @exchanges[name] != type
+              raise AMQError.new("Exchange #{name} was declared as #{@exchanges[name]}")
+            end
+          else
+            unless ["direct", "topic", "fanout"].include?(type)
+              raise AMQError.new("Unsupported exchange type: #{type}")
+            end
+            @exchanges[name] = type
+            @bindings[name]  = []
+          end
+        end
+      end
+
+      def declare_queue(name, passive, exclusive, auto_delete)
+        @lock.synchronize do
+          name = "loopback-#{@serial += 1}" if name.nil? || name.empty?
+          if passive && !@queues.has_key?(name)
+            raise AMQError.new("No such queue: #{name}")
+          end
+          @queues[name] ||= Queue.new(name, RWire::LocalQueue.new, [], exclusive, auto_delete, 0)
+          name
+        end
+      end
+
+      def delete_queue(name, if_unused, if_empty)
+        @lock.synchronize do
+          q = @queues[name]
+          raise AMQError.new("No such queue: #{name}") unless q
+          raise AMQError.new("Queue #{name} is in use") if if_unused && !q.consumers.empty?
+          raise AMQError.new("Queue #{name} is not empty") if if_empty && q.backlog.size > 0
+          remove_queue(q)
+        end
+      end
+
+      def bind_queue(queue, exchange, routing_key)
+        exchange = "amq.direct" if exchange.nil? || exchange.empty?
+        @lock.synchronize do
+          raise AMQError.new("No such exchange: #{exchange}") unless @exchanges.has_key?(exchange)
+          raise AMQError.new("No such queue: #{queue}") unless @queues.has_key?(queue)
+          binding = [routing_key.to_s, queue]
+          @bindings[exchange] << binding unless @bindings[exchange].include?(binding)
+        end
+      end
+
+      # Start delivering the contents of a queue into a session's arrived
+      # queue, starting with what is waiting there already
+      def consume(queue, tag, session, exclusive)
+        @lock.synchronize do
+          q = @queues[queue]
+          raise AMQError.new("No such queue: #{queue}") unless q
+          if !q.consumers.empty? && (exclusive || q.exclusive)
+            raise AMQError.new("Queue #{queue} is in exclusive use")
+          end
+          q.consumers << [tag, session]
+          q.backlog.move_to(session.arrived)
+        end
+      end
+
+      def cancel(tag)
+        @lock.synchronize do
+          @queues.values.each do |q|
+            next unless q.consumers.reject! { |t, _| t == tag }
+            remove_queue(q) if q.consumers.empty? && q.auto_delete
+          end
+        end
+      end
+
+      # Route a content to the queues bound to exchange with a matching key.
+      # Returns :delivered, :unroutable or :undeliverable (routed, but without
+      # consumers for an immediate publish).
+      def route(content, exchange, routing_key, immediate)
+        exchange    = exchange.to_s
+        routing_key = routing_key.to_s
+        @lock.synchronize do
+          queues = matching_queues(exchange, routing_key)
+          return :unroutable if queues.empty?
+          return :undeliverable if immediate && queues.all? { |q| q.consumers.empty? }
+
+          queues.each do |q|
+            if q.consumers.empty?
+              q.backlog.push(content, exchange, routing_key)
+            else
+              # Round robin between the consumers
+              q.next = (q.next + 1) % q.consumers.size
+              q.consumers[q.next][1].arrived.push(content, exchange, routing_key)
+            end
+          end
+          :delivered
+        end
+      end
+
+      # Take the next content waiting in queue, or nil
+      def get(queue)
+        @lock.synchronize do
+          q = @queues[queue]
+          raise AMQError.new("No such queue: #{queue}") unless q
+          q.backlog.shift
+        end
+      end
+
+      # Does a topic binding key match a routing key?  Words are separated by
+      # dots; * matches one word and # matches zero or more.
+      def self.topic_match?(pattern, key)
+        match_words(pattern.split(".", -1), key.split(".", -1))
+      end
+
+      def self.match_words(pattern, words)
+        return words.empty? if pattern.empty?
+        if pattern[0] == "#"
+          rest = pattern[1..-1]
+          (0..words.size).any? { |i| match_words(rest, words[i..-1]) }
+        elsif words.empty?
+          false
+        else
+          (pattern[0] == "*" || pattern[0] == words[0]) &&
+            match_words(pattern[1..-1], words[1..-1])
+        end
+      end
+
+    private
+
+      def matching_queues(exchange, routing_key)
+        if exchange.empty?
+          # The default exchange routes to the queue named by the key
+          return @queues.has_key?(routing_key) ? [@queues[routing_key]] : []
+        end
+
+        type = @exchanges[exchange]
+        raise AMQError.new("No such exchange: #{exchange}") unless type
+        names = @bindings[exchange].select do |key, _|
+          case type
+          when "fanout" then true
+          when "topic"  then Broker.topic_match?(key, routing_key)
+          else               key == routing_key
+          end
+        end.map { |_, queue| queue }
+        names.uniq.map { |name| @queues[name] }.compact
+      end
+
+      def remove_queue(q)
+        q.backlog.clear
+        q.backlog.close
+        @queues.delete(q.name)
+        @bindings.each_value { |b| b.reject! { |_, queue| queue == q.name } }
+      end
+    end
+
+    class Connection
+      def initialize(*args)
+        @alive = true
+      end
+
+      def session_new
+        raise AMQDestroyedError.new("Connection has been destroyed") unless @alive
+        Session.new(Broker.instance)
+      end
+
+      def alive?
+        @alive
+      end
+
+      def destroy
+        @alive = false
+        nil
+      end
+    end
+
+    class Session
+      # How long wait_active sleeps between looks at the flow, in seconds
+      FLOW_NAP = 0.01
+
+      # Contents delivered to this session's consumers
+      attr_reader :arrived
+      attr_reader :queue, :exchange, :consumer_tag
+      attr_accessor :capture, :rate_limiter
+
+      def initialize(broker)
+        @broker    = broker
+        @arrived   = RWire::LocalQueue.new
+        @returned  = RWire::LocalQueue.new
+        @consumers = []
+        @alive     = true
+        @active    = true
+      end
+
+      def destroy
+        return unless @alive
+        @consumers.each { |tag| @broker.cancel(tag) }
+        @consumers.clear
+        @arrived.clear
+        @returned.clear
+        @arrived.close
+        @alive = false
+        nil
+      end
+
+      def alive?
+        @alive
+      end
+
+      def active?
+        @active
+      end
+
+      def channel_flow(active)
+        @active = active
+      end
+
+      # Wait until channel_flow lets the session publish again, for up to
+      # timeout (msecs, 0 or nil for none, or an RWire::Deadline).  Returns
+      # true once the session is active, false on timeout or if the session
+      # was destroyed.
+      def wait_active(timeout)
+        if timeout.is_a?(RWire::Deadline)
+          deadline = timeout
+        elsif timeout && timeout > 0
+          deadline = RWire::Deadline.new(timeout)
+        end
+        until @active
+          return false if !@alive || (deadline && deadline.expired?)
+          sleep(FLOW_NAP)
+        end
+        true
+      end
+
+      # Returns 0 once something has arrived or was returned, or when the
+      # timeout (msecs, 0 or nil for none, or an RWire::Deadline) expires
+      def wait(timeout)
+        check_alive
+        @arrived.wait(timeout) if @returned.size == 0
+        @alive ? 0 : -1
+      end
+
+      def declare_exchange(exchange, type, passive, durable, undeletable, internal)
+        check_alive
+        @broker.declare_exchange(exchange, type, passive)
+        @exchange = exchange
+      end
+
+      def declare_queue(queue, passive, durable, exclusive, auto_delete)
+        check_alive
+        @queue = @broker.declare_queue(queue, passive, exclusive, auto_delete)
+      end
+
+      def delete_queue(queue, if_unused, if_empty)
+        check_alive
+        @broker.delete_queue(queue, if_unused, if_empty)
+      end
+
+      def bind_queue(queue, exchange, routing_key)
+        check_alive
+        @broker.bind_queue(queue, exchange, routing_key)
+      end
+
+      def consume(queue, consumer_tag, no_local, no_ack, exclusive)
+        check_alive
+        @consumer_tag = consumer_tag || "loopback-consumer-#{@broker.next_serial}"
+        @broker.consume(queue, @consumer_tag, self, exclusive)
+        @consumers << @consumer_tag
+        @consumer_tag
+      end
+
+      def basic_cancel(consumer_tag)
+        @broker.cancel(consumer_tag)
+        @consumers.delete(consumer_tag)
+      end
+
+      def publish_body(body, exchange, routing_key, mandatory, immediate, reply_to)
+        check_alive
+        content = RWire::Content.new
+        content.body     = body
+        content.reply_to = reply_to if reply_to
+        publish(content, exchange, routing_key, mandatory, immediate)
+      ensure
+        content.unlink if content
+      end
+
+      def publish_content(content, exchange, routing_key, mandatory, immediate)
+        check_alive
+        publish(content, exchange, routing_key, mandatory, immediate)
+      end
+
+      def basic_arrived
+        content = @arrived.shift
+        @capture.record(:consumed, content, nil, nil) if content && @capture
+        content
+      end
+
+      def basic_arrived_count
+        @arrived.size
+      end
+
+      def basic_returned
+        @returned.shift
+      end
+
+      def basic_returned_count
+        @returned.size
+      end
+
+      def basic_get(queue)
+        check_alive
+        content = @broker.get(queue)
+        @arrived.push(content) if content
+      ensure
+        content.unlink if content
+      end
+
+      # Nothing is redelivered, so there is nothing to acknowledge
+      def basic_ack(delivery_tag, multiple)
+        nil
+      end
+
+    private
+
+      def publish(content, exchange, routing_key, mandatory, immediate)
+        @rate_limiter.acquire(content.body_size) if @rate_limiter
+        case @broker.route(content, exchange, routing_key, immediate)
+        when :unroutable
+          @returned.push(content, exchange.to_s, routing_key.to_s) if mandatory
+        when :undeliverable
+          @returned.push(content, exchange.to_s, routing_key.to_s)
+        end
+        @capture.record(:published, content, exchange, routing_key) if @capture
+        self
+      end
+
+      def check_alive
+        raise AMQDestroyedError.new("Session has been destroyed") unless @alive
+      end
+    end
+  end
+end
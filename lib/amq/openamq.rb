@@ -26,6 +26,10 @@
 # POSSIBILITY OF SUCH DAMAGE.
 
 require 'rwire'
+require 'socket'
+require 'zlib'
+require 'etc'
+require 'amq/loopback'
 
 module AMQ
   class Connection
@@ -33,6 +37,18 @@ module AMQ
       Connection.new(*args, &blk)
     end
 
+    # Pass :host => :loopback to keep messages inside the process, without a
+    # broker.  See RWire::Loopback.
+    #
+    # A forked child lets go of the parent's socket, and reports the
+    # connection as not alive.  It can't open its own if the parent had
+    # started WireAPI (see RWire::Connection.new), so preforking servers
+    # should only connect in their workers.  Loopback connections are
+    # reopened in the child the first time they're used.
+    #
+    # Host names are looked up once per process tree: the first connection
+    # to a host resolves it, and later connections and forked children reuse
+    # the answer.
     def initialize(args={})
       host    = args[:host] || "localhost"
       vhost   = args[:vhost] || "/"
@@ -42,7 +58,9 @@ module AMQ
       trace   = args[:trace] || args[:trace_level] || 0
       timeout = args[:timeout] || 5000    # Five second default timeout
 
-      @conn = RWire::Connection.new(host, vhost, user, pass, client, trace, timeout)
+      @config = [host, vhost, user, pass, client, trace, timeout]
+      @conn   = open_connection(host)
+      @pid    = Process.pid
 
       if block_given?
         result = yield self
@@ -57,8 +75,19 @@ module AMQ
       destroy
     end
 
+    # A forked child has nothing to close: the parent's connection is not
+    # its own
+    def destroy
+      @conn.destroy if @pid == Process.pid
+      nil
+    end
+
+    def alive?
+      @pid == Process.pid && @conn.alive?
+    end
+
     def new_session()
-      s = Session.new(@conn.session_new(), self)
+      s = Session.new(connection.session_new(), self)
       if block_given?
         result = yield s
         s.destroy
@@ -70,42 +99,213 @@ module AMQ
 
     def method_missing(meth, *args, &blk)
       if @conn.respond_to?(meth)
-        @conn.send(meth, *args, &blk)
+        connection.send(meth, *args, &blk)
       else
         super.method_missing(meth, *args, &blk)
       end
     end
+
+    @resolved = {}
+
+    # host[:port] with the name resolved, looked up only the first time.
+    # Forked children inherit the answer.
+    def self.resolve(host)
+      return host if host.to_s == "loopback"
+      @resolved[host] ||= begin
+        name, port = host.split(":", 2)
+        if name =~ /\A[\d.]+\z/
+          host
+        else
+          address = Socket.getaddrinfo(name, nil, nil, Socket::SOCK_STREAM)[0][3]
+          if address.include?(":")   # Leave IPv6 to WireAPI
+            host
+          else
+            port ? "#{address}:#{port}" : address
+          end
+        end
+      rescue SocketError
+        host
+      end
+    end
+
+  private
+
+    # The connection of this process, reconnecting if this is a forked child
+    def connection
+      if @pid != Process.pid
+        @conn = open_connection(@config[0])
+        @pid  = Process.pid
+      end
+      @conn
+    end
+
+    # Connect to host at the address Connection.resolve has for it
+    def open_connection(host)
+      if host.to_s == "loopback"
+        return RWire::Loopback::Connection.new(host, *@config[1..-1])
+      end
+
+      RWire::Connection.new(Connection.resolve(host), *@config[1..-1])
+    end
   end
 
   class Session
+    # Content properties that publish and publish_content copy from their
+    # arguments onto the message
+    CONTENT_PROPERTIES = [:message_id, :correlation_id, :reply_to, :content_type,
+                          :content_encoding, :expiration, :user_id, :app_id,
+                          :priority, :delivery_mode, :timestamp]
+
+    # Msecs publish waits for the broker to resume the flow before giving up
+    attr_accessor :flow_timeout
+    # How many mandatory/immediate publishes are remembered for matching up
+    # with returned messages
+    attr_accessor :return_window
+    # Total msecs publishers were held back by channel flow
+    attr_reader :throttled_time
+
     def initialize(rwire_session, connection)
       @conn = connection
       @sess = rwire_session
+
+      @flow_timeout   = 5000
+      @return_window  = 1000
+      @throttled_time = 0
+      @outstanding    = {}
+      @returned       = []
+      @published      = 0
     end
 
     def close
       destroy
     end
 
-    def publish(args)
-      args[:body] ||= ""
-      args[:mandatory] ||= false
-      args[:immediate] ||= false
+    # The underlying RWire::Session, for handing to the native helpers
+    def rwire_session
+      @sess
+    end
 
-      @sess.publish_body(args[:body], args[:exchange], args[:routing_key],
-                         args[:mandatory], args[:immediate], args[:reply_to])
+    # Publishes :body, or :object encoded as :format (:json, the default, or
+    # :msgpack) straight into the message body, with the content type set
+    # to match.
+    def publish(args)
+      deliver(args)
+      process_returned
+      self
     end
 
     def publish_content(args)
-      args[:body] ||= ""
-      args[:mandatory] ||= false
-      args[:immediate] ||= false
+      prepare_args(args)
+      throttle
+      args = track(args)
+      send_content(args)
+      process_returned
+      self
+    end
 
-      c = RWire::Content.new
-      c.body = args[:body]
-      @sess.publish_content(c, args[:exchange], args[:routing_key], args[:mandatory], args[:immediate])
+    # Register a block to be called with every message the broker returns,
+    # and the arguments it was published with (nil if it's no longer
+    # remembered).  Without a handler returned messages are queued for
+    # returned_messages.
+    def on_return(&blk)
+      @return_handler = blk
+    end
+
+    # Returns and forgets the queued [content, publish arguments] pairs.  The
+    # contents should be unlinked once done with.
+    def returned_messages
+      process_returned
+      result, @returned = @returned, []
+      result
+    end
+
+    # Hand the messages returned by the broker so far to the on_return
+    # handler, or queue them.  Returns the message ids of those messages.
+    # Called from publish, wait and consume, so there's no need to poll.
+    def process_returned
+      ids = []
+      while @sess.basic_returned_count > 0
+        content = @sess.basic_returned
+        break unless content
+
+        ids << content.message_id
+        args = @outstanding.delete(ids.last)
+        if @return_handler
+          begin
+            @return_handler.call(content, args)
+          ensure
+            content.unlink
+          end
+        else
+          @returned << [content, args]
+        end
+      end
+      ids
+    end
+
+    # Append every message published or consumed on this session from now on
+    # to a capture file at path, for replaying with bin/amq_replay.  A failed
+    # write stops the capture, and stop_capture raises it.
+    def start_capture(path)
+      stop_capture
+      @sess.capture = RWire::Capture.new(path)
+    end
+
+    def stop_capture
+      capture, @sess.capture = @sess.capture, nil
+      capture.close if capture
+      capture
+    end
+
+    # Cap the rate at which this session publishes.  :messages and :bytes
+    # are per second limits (nil for none) and :burst is how many seconds'
+    # worth may go out back to back (default 0.1).  Publishers over the limit
+    # sleep, or raise AMQRateLimitError with :fail_fast.  Pass :limiter to
+    # share one RWire::RateLimiter between sessions, e.g. per tenant, and nil
+    # to lift the limit.
+    def rate_limit(args)
+      @sess.rate_limiter = Session.rate_limiter(args)
+    end
+
+    # The RWire::RateLimiter for the arguments of #rate_limit, or nil
+    def self.rate_limiter(args)
+      args && (args[:limiter] ||
+        RWire::RateLimiter.new(args[:messages], args[:bytes], args[:burst],
+                               args[:fail_fast] || false))
+    end
+
+    # False while the broker has asked us to stop publishing
+    def flowing?
+      @sess.active?
+    end
+
+    def wait(timeout)
+      rc = @sess.wait(timeout)
+      process_returned
+      rc
+    end
+
+    # Returns an RWire::Publisher for sending many messages with the same
+    # exchange, routing key and properties.  Only the body is given per
+    # message:
+    #
+    #   pub = s.prepare_publisher(:exchange    => "amq.direct",
+    #                             :routing_key => "quotes",
+    #                             :properties  => { :content_type  => "text/plain",
+    #                                               :delivery_mode => 2 })
+    #   pub.call("Hello")
+    def prepare_publisher(args)
+      unless @sess.is_a?(RWire::Session)
+        raise ArgumentError.new("Prepared publishers need a broker session")
+      end
+      template = RWire::Content.new
+      (args[:properties] || {}).each do |name, value|
+        template.send("#{name}=", value)
+      end
+      RWire::Publisher.new(@sess, template, args[:exchange], args[:routing_key],
+                           args[:mandatory] || false, args[:immediate] || false)
     ensure
-      c.unlink
+      template.unlink if template
     end
 
     def declare_exchange(args)
@@ -152,6 +352,38 @@ module AMQ
       @sess.bind_queue(args[:queue], args[:exchange], args[:routing_key])
     end
 
+    # Start consuming from :queue.  Given a block, waits for contents and
+    # yields each body and content until the block returns false, the
+    # session dies or nothing arrives within :timeout msecs.
+    #
+    # With :conflate => key (as for Dispatcher, or [key, prefix_length]) only
+    # the latest content per key is yielded; a consumer that falls behind
+    # skips the updates that have been superseded since (acknowledging them
+    # when :no_ack is false).  Contents still buffered when consume returns
+    # are handed back to the session, for its next basic_arrived.
+    #
+    # With :dedup contents whose message_id was already seen are dropped
+    # (and acknowledged when :no_ack is false), and the rest still buffered
+    # when consume returns are handed back to the session.  Pass an RWire::Deduplicator
+    # to keep what was seen across consumers, or a Hash with :capacity
+    # (default 100000 keys), :window (msecs, default unlimited) and :key.
+    #
+    # With :decode bodies are decoded as their content type says (JSON or
+    # MessagePack) and the resulting object is yielded instead of the body;
+    # add :symbolize_keys for Symbol keys.  Bodies that can't be decoded
+    # raise AMQDecodeError.
+    #
+    # With :priority contents that have arrived are yielded highest priority
+    # first, rather than in arrival order.  Pass true to go by the priority
+    # property, a header name to go by a numeric header, or a Hash with
+    # :header, :levels (default 10) and :fairness: after that many contents
+    # in a row (default 16, 0 for never) have gone ahead of lower priority
+    # ones, the longest waiting content goes next.  Contents still buffered
+    # when consume returns are handed back to the session.
+    #
+    # :timeout restarts whenever something arrives.  :deadline (msecs or an
+    # RWire::Deadline) bounds the whole call, after which :timed_out is
+    # returned.
     def consume(args)
       args[:no_local] = true unless args.has_key?(:no_local)
       args[:no_ack]   = true unless args.has_key?(:no_ack)
@@ -162,45 +394,63 @@ module AMQ
                     args[:no_ack], args[:exclusuve])
       if block_given?
         consumer_tag = @sess.consumer_tag
+        source = arrived_source(args)
+        deadline = args[:deadline] && to_deadline(args[:deadline], 0)
+        idle = idle_deadline(args[:timeout])
         loop do
-          rc = @sess.wait(args[:timeout])
+          rc = wait(sooner(idle, deadline))
           if rc != 0
             # session died
             puts "wait returns non zero: #{rc}"
             break
           end
 
-          if @sess.basic_arrived_count == 0
-            # timed out
-            # TODO: should probably raise an exception
-            return :timed_out
+          # A wake-up can bring nothing for us: a returned message, or only
+          # duplicates.  Only the clock says when we've timed out.
+          if source.basic_arrived_count == 0
+            if (idle && idle.expired?) || (deadline && deadline.expired?)
+              # TODO: should probably raise an exception
+              return :timed_out
+            end
+            next
           end
 
-          while @sess.basic_arrived_count > 0
+          while source.basic_arrived_count > 0
+            return :timed_out if deadline && deadline.expired?
             begin
-              content = @sess.basic_arrived
-              body = content.body
+              content = source.basic_arrived
+              body = args[:decode] ? content.decode_body(nil, args[:symbolize_keys]) :
+                                     content.body
               # caller wants to stop if yield returns false
-              break if !yield(body, content)
+              return nil if !yield(body, content)
             ensure
               content.unlink if content
             end # begin
           end # while
+          idle = idle_deadline(args[:timeout]) unless args[:timeout].is_a?(RWire::Deadline)
         end # loop
       end
     ensure
       if block_given?
-        @sess.basic_cancel(consumer_tag)
+        begin
+          @sess.basic_cancel(consumer_tag)
+        ensure
+          # A conflator, deduplicator or prioritizer has taken its contents
+          # off the session; give back the ones never yielded
+          source.release if source && !source.equal?(@sess)
+        end
       end
     end
 
     require 'pp'
     # Takes all the arguments that publish method takes. In addition, timeout
-    # (in seconds) for waiting for reply can be specified
+    # (in msecs, or an RWire::Deadline) for the whole request can be
+    # specified
     def request(args)
       args = args.dup
       args[:immediate] = false
       args[:mandatory] = true
+      deadline = to_deadline(args[:deadline] || args[:timeout], 500)
 
       consumer_tag = nil
 
@@ -208,9 +458,7 @@ module AMQ
       queue = declare_and_bind_private_queue()
       # Send out the request
       args[:reply_to] = queue
-      publish(args)
-
-      args[:timeout] ||= 500
+      deliver(args)
 
       # Listen for the reply msg(s)
       consume(:queue     => queue,
@@ -218,20 +466,88 @@ module AMQ
 
       consumer_tag = @sess.consumer_tag
 
-      rc = wait(args[:timeout])
-      if rc == 0
-        if basic_returned_count > 0
+      loop do
+        rc = @sess.wait(deadline)
+        if rc != 0
+          raise AMQError.new("Failed.  Interrupted while waiting for response.")
+        end
+
+        if process_returned.include?(args[:message_id])
           raise AMQError.new("Failed to send request.  Message returned from broker.")
         end
 
-        if basic_arrived_count == 0
-          return :timeout
+        return basic_arrived.body if basic_arrived_count > 0
+        return :timeout if deadline.expired?
+      end
+    ensure
+      @sess.basic_cancel(consumer_tag) if consumer_tag
+    end
+
+    # Send several requests at once and gather their replies.  Each request
+    # is a Hash of the arguments publish takes.  All replies come back on one
+    # private queue and are matched to their request by correlation_id, so
+    # responders must copy the request's correlation_id into the reply.
+    #
+    # Returns an Array of reply bodies in request order, with nil for the
+    # requests that weren't answered.  Returns as soon as :quorum replies
+    # (default all) are in, once the quorum can no longer be reached because
+    # the broker returned requests, or after :timeout msecs (default 500) in
+    # total.  :timeout may also be an RWire::Deadline.
+    #
+    #   s.scatter(shards.map { |k| { :body => query, :routing_key => k } },
+    #             :timeout => 200, :quorum => shards.size - 1)
+    def scatter(requests, args={})
+      deadline = to_deadline(args[:timeout], 500)
+      quorum   = [args[:quorum] || requests.size, requests.size].min
+      replies  = Array.new(requests.size)
+      pending  = {}   # correlation id => request index
+      requests_by_message_id = {}
+
+      consumer_tag = nil
+      queue = declare_and_bind_private_queue()
+      consume(:queue     => queue,
+              :exclusive => true)
+      consumer_tag = @sess.consumer_tag
+
+      prefix = "#{Process.pid}-#{object_id}-#{@published += 1}"
+      requests.each_with_index do |request, i|
+        request = request.dup
+        request[:reply_to]       = queue
+        request[:correlation_id] = "#{prefix}-#{i}"
+        request[:immediate]      = false
+        request[:mandatory]      = true
+        deliver(request)
+        pending[request[:correlation_id]] = i
+        requests_by_message_id[request[:message_id]] = request[:correlation_id]
+      end
+
+      answered = 0
+      while answered < quorum && answered + pending.size >= quorum
+        break if deadline.expired?
+
+        if @sess.wait(deadline) != 0
+          raise AMQError.new("Failed.  Interrupted while waiting for responses.")
         end
 
-        return basic_arrived.body
-      else
-        raise AMQError.new("Failed.  Interrupted while waiting for response.")
+        # Returned requests will never be answered
+        process_returned.each do |id|
+          pending.delete(requests_by_message_id[id])
+        end
+
+        while content = @sess.basic_arrived
+          begin
+            i = pending.delete(content.correlation_id)
+            if i
+              replies[i] = content.body
+              answered += 1
+            end
+          ensure
+            content.unlink
+          end
+        end
       end
+
+      replies
     ensure
       @sess.basic_cancel(consumer_tag) if consumer_tag
     end
@@ -246,6 +562,125 @@ module AMQ
 
   private
 
+    # Where consume takes arrived contents from: the session itself, or a
+    # native buffer in front of it
+    def arrived_source(args)
+      if [:conflate, :dedup, :priority].count { |k| args[k] } > 1
+        raise ArgumentError.new("Use only one of :conflate, :dedup and :priority")
+      end
+      if (args[:conflate] || args[:dedup] || args[:priority]) && !@sess.is_a?(RWire::Session)
+        raise ArgumentError.new("Conflating, deduplicating and prioritizing need a broker session")
+      end
+
+      if args[:conflate]
+        RWire::Conflator.new(@sess, args[:conflate], !args[:no_ack])
+      elsif args[:dedup]
+        dedup = args[:dedup]
+        unless dedup.is_a?(RWire::Deduplicator)
+          dedup = {} unless dedup.is_a?(Hash)
+          dedup = RWire::Deduplicator.new(dedup[:capacity] || 100_000,
+                                          dedup[:window],
+                                          dedup[:key] || :message_id,
+                                          !args[:no_ack])
+        end
+        dedup.session = @sess
+        dedup
+      elsif args[:priority]
+        priority = args[:priority]
+        priority = { :header => priority } if priority.is_a?(String)
+        priority = {} unless priority.is_a?(Hash)
+        RWire::Prioritizer.new(@sess, priority[:levels] || 10, priority[:header],
+                               priority[:fairness] || 16)
+      else
+        @sess
+      end
+    end
+
+    def prepare_args(args)
+      args[:body] ||= ""
+      args[:mandatory] ||= false
+      args[:immediate] ||= false
+    end
+
+    # Publish without looking at returned messages.  Plain bodies go straight
+    # out; anything with content properties is sent as a content.
+    def deliver(args)
+      prepare_args(args)
+      throttle
+      args = track(args)
+      if args.has_key?(:object) || CONTENT_PROPERTIES.any? { |p| p != :reply_to && args[p] }
+        send_content(args)
+      else
+        @sess.publish_body(args[:body], args[:exchange], args[:routing_key],
+                           args[:mandatory], args[:immediate], args[:reply_to])
+      end
+    end
+
+    def send_content(args)
+      c = RWire::Content.new
+      if args.has_key?(:object)
+        c.encode_body(args[:object], args[:format] || :json)
+      else
+        c.body = args[:body]
+      end
+      CONTENT_PROPERTIES.each do |p|
+        c.send("#{p}=", args[p]) if args[p]
+      end
+      @sess.publish_content(c, args[:exchange], args[:routing_key], args[:mandatory], args[:immediate])
+    ensure
+      c.unlink if c
+    end
+
+    # Remember a publish the broker may return, so that the returned message
+    # can be matched with it.  Messages without a message id get one, on a
+    # copy of the arguments so that a Hash reused between publishes doesn't
+    # keep it.  Returns the arguments to publish with.
+    def track(args)
+      return args unless args[:mandatory] || args[:immediate]
+
+      unless args[:message_id]
+        args = args.merge(:message_id => "#{Process.pid}-#{object_id}-#{@published += 1}")
+      end
+      @outstanding.shift while @outstanding.size >= @return_window
+      @outstanding[args[:message_id]] = args
+      args
+    end
+
+    # Hold the publisher back while the broker has stopped the channel flow
+    def throttle
+      return if @sess.active?
+
+      started = RWire.monotonic_time
+      begin
+        active = @sess.wait_active(RWire::Deadline.new(@flow_timeout))
+        process_returned
+        raise AMQError.new("Broker has stopped the flow of messages") unless active
+      ensure
+        @throttled_time += ((RWire.monotonic_time - started) * 1000).to_i
+      end
+    end
+
+    # A timeout in msecs or an RWire::Deadline, as an RWire::Deadline
+    def to_deadline(timeout, default)
+      timeout ||= default
+      timeout.is_a?(RWire::Deadline) ? timeout : RWire::Deadline.new(timeout)
+    end
+
+    # The RWire::Deadline an idle timeout in msecs (0 for none) runs out at,
+    # or nil
+    def idle_deadline(timeout)
+      return timeout if timeout.is_a?(RWire::Deadline)
+      timeout == 0 ? nil : RWire::Deadline.new(timeout)
+    end
+
+    # Whichever comes first of two RWire::Deadlines, either of which may be
+    # nil; 0 (wait for as long as it takes) if both are
+    def sooner(idle, deadline)
+      return deadline || 0 if idle.nil?
+      return idle if deadline.nil? || idle.remaining < deadline.remaining
+      deadline
+    end
+
     # Declare a private queue and bind it.  Return the private queue name
     def declare_and_bind_private_queue
       declare_queue(:exclusive => true, :auto_delete => true)
@@ -259,6 +694,336 @@ module AMQ
 
   end
 
+  # Spreads the contents arriving on one or more sessions over a pool of
+  # worker threads.  Workers wait for contents with the interpreter lock
+  # released, and idle workers steal from busy ones.
+  #
+  # By default the workers are Ruby threads calling the block, so blocks
+  # take turns on the interpreter lock and only overlap while they block on
+  # I/O.  With :handler the workers are native threads instead, running a
+  # built-in handler on every body without the lock, on as many cores as
+  # there are workers.  The block then runs on a single Ruby thread with
+  # the handler's result in place of the body:
+  #
+  #   :hash     64-bit FNV-1a of the body
+  #   :crc32    CRC-32 of the body, as Zlib.crc32
+  #   :inflate  the body inflated from zlib or gzip, as a binary String
+  #
+  # RWire::Dispatcher.handlers lists the ones this build has (:crc32 and
+  # :inflate need zlib).  A body the handler fails on is an AMQDecodeError,
+  # passed to :on_error like an exception from the block.
+  #
+  # Pass :key (:routing_key, :message_id or a header name) to keep the
+  # contents sharing a key in order.  Every key is then handled by a single
+  # worker, and there is no stealing.
+  #
+  # An exception raised by the block is passed to :on_error, with the
+  # content, and the worker moves on to its next content.  Without
+  # :on_error the first exception stops the dispatcher, and run re-raises
+  # it once the workers are done.
+  #
+  # Messages the broker returns are handed to the AMQ::Session they were
+  # published on.  On a bare RWire::Session they go to :on_return, or are
+  # dropped.
+  #
+  #   d = AMQ::Dispatcher.new(:workers => 8, :key => :routing_key)
+  #   d.add(session)
+  #   d.run { |body, content| ... }
+  #
+  #   d = AMQ::Dispatcher.new(:workers => 8, :handler => :inflate)
+  #   d.add(session)
+  #   d.run { |inflated, content| ... }
+  class Dispatcher
+    def initialize(args={})
+      @workers    = args[:workers] || 4
+      @timeout    = args[:timeout] || 100  # msecs to wait on each session
+      @handler    = args[:handler]
+      if @handler && !RWire::Dispatcher.handlers.include?(@handler)
+        raise ArgumentError.new("Unknown handler #{@handler.inspect}")
+      end
+      @dispatcher = RWire::Dispatcher.new(@workers, args[:key])
+      @on_error   = args[:on_error]
+      @on_return  = args[:on_return]
+      @sessions   = []
+      @lock       = Mutex.new
+    end
+
+    # Add a session to take arrived contents from.  The session must already
+    # be consuming.
+    def add(session)
+      owner   = session.respond_to?(:rwire_session) ? session : nil
+      session = owner.rwire_session if owner
+      unless session.is_a?(RWire::Session)
+        raise ArgumentError.new("The dispatcher needs broker sessions")
+      end
+      @sessions << [session, owner]
+      self
+    end
+
+    # Start the workers and feed them until stop is called or a session dies.
+    # The block is called with the content body (or the handler's result)
+    # and the content, which is unlinked once the block returns.  Contents
+    # still queued when feeding stops are handled before run returns.  A
+    # dispatcher runs once.
+    def run(&blk)
+      @running = true
+      @error   = nil
+      if @handler
+        @dispatcher.start(@handler)
+        threads = [Thread.new { collect(&blk) }]
+      else
+        threads = (0...@workers).map do |i|
+          Thread.new { work(i, &blk) }
+        end
+      end
+
+      slice = [@timeout / [@sessions.size, 1].max, 1].max
+      while @running
+        @sessions.each do |s, owner|
+          if s.wait(slice) != 0
+            # session died
+            @running = false
+            break
+          end
+          @dispatcher.pull(s)
+          # wait returns at once while there are returned messages
+          returned(s, owner) if s.basic_returned_count > 0
+        end
+      end
+    ensure
+      @dispatcher.close
+      threads.each { |t| t.join } if threads
+      raise @error if @error
+    end
+
+    # Stop feeding the workers.  Safe to call from within a worker.
+    def stop
+      @running = false
+    end
+
+    def stats
+      { :workers    => @dispatcher.workers,
+        :pending    => @dispatcher.size,
+        :dispatched => @dispatcher.dispatched,
+        :stolen     => @dispatcher.stolen }
+    end
+
+  private
+
+    def work(worker)
+      while content = @dispatcher.take(worker, nil)
+        begin
+          yield(content.body, content)
+        rescue Exception => e
+          failed(e, content)
+        ensure
+          content.unlink
+        end
+      end
+    end
+
+    # Hand the native workers' results to the block
+    def collect
+      while pair = @dispatcher.collect(nil)
+        content, result = pair
+        begin
+          if result.is_a?(Exception)
+            failed(result, content)
+          else
+            yield(result, content)
+          end
+        rescue Exception => e
+          failed(e, content)
+        ensure
+          content.unlink
+        end
+      end
+    end
+
+    def returned(session, owner)
+      return owner.process_returned if owner
+      while content = session.basic_returned
+        begin
+          @on_return.call(content) if @on_return
+        ensure
+          content.unlink
+        end
+      end
+    end
+
+    def failed(error, content)
+      if @on_error
+        begin
+          return @on_error.call(error, content)
+        rescue Exception => error
+        end
+      end
+      @lock.synchronize { @error ||= error }
+      stop
+    end
+  end
+
+  # Publishes over several connections at once, for producers that a single
+  # connection can't keep up with.  Each connection has its own socket,
+  # WireAPI client thread and channel flow, so a slow or throttled one
+  # doesn't hold up the rest.  Publishing itself holds the interpreter lock,
+  # so more connections don't make the Ruby side any faster.
+  #
+  # With :route => :hash (the default) messages are spread by routing key,
+  # so messages with the same routing key keep their order.  Messages
+  # without a routing key, and all messages with :route => :round_robin, go
+  # to each connection in turn.
+  #
+  #   pub = AMQ::ShardedPublisher.new(:host => "broker:5672", :connections => 8)
+  #   pub.publish(:body => "Hello", :exchange => "amq.topic", :routing_key => "a.b")
+  #   pub.publish_batch(messages)
+  #   pub.close
+  #
+  # Takes the arguments of AMQ::Connection.new as well.  :rate_limit (the
+  # arguments of Session#rate_limit) caps the total rate over all
+  # connections.
+  class ShardedPublisher
+    Shard = Struct.new(:connection, :session, :lock, :published, :bytes)
+
+    attr_reader :route
+
+    def initialize(args={})
+      count  = args[:connections] ||
+               (Etc.respond_to?(:nprocessors) ? Etc.nprocessors : 4)
+      @route = args[:route] || :hash
+      unless [:hash, :round_robin].include?(@route)
+        raise ArgumentError.new("Unknown route #{@route.inspect}")
+      end
+
+      limiter = Session.rate_limiter(args[:rate_limit])
+
+      # Connect in parallel; RWire::Connection.new lets go of the interpreter
+      # lock while it waits on the broker
+      threads = (0...count).map do
+        Thread.new do
+          connection = Connection.new(args)
+          session    = connection.new_session
+          session.rate_limit(:limiter => limiter) if limiter
+          Shard.new(connection, session, Mutex.new, 0, 0)
+        end
+      end
+      results = threads.map { |t| begin; t.value; rescue Exception => e; e; end }
+      @shards = results.select { |r| r.is_a?(Shard) }
+      if failed = results.find { |r| r.is_a?(Exception) }
+        close_shards(@shards)
+        raise failed
+      end
+
+      @next = 0
+      @next_lock = Mutex.new
+    end
+
+    def connections
+      @shards.size
+    end
+
+    # Publish one message, given as for Session#publish
+    def publish(args)
+      check_open
+      shard = shard_for(args[:routing_key])
+      shard.lock.synchronize { send_to(shard, args) }
+      self
+    end
+
+    # Publish an Array of messages, taking each connection's lock once
+    def publish_batch(messages)
+      check_open
+      messages.group_by { |args| shard_for(args[:routing_key]) }.each do |shard, batch|
+        shard.lock.synchronize do
+          batch.each { |args| send_to(shard, args) }
+        end
+      end
+      self
+    end
+
+    # Register a block for returned messages on every connection, as for
+    # Session#on_return
+    def on_return(&blk)
+      @shards.each { |shard| shard.session.on_return(&blk) }
+    end
+
+    # Wait until the broker has seen everything published so far.  A
+    # synchronous method on a channel is answered only after the messages
+    # published before it, so a passive declare on each session is a
+    # barrier.  The connections are flushed in parallel, as the declare
+    # lets go of the interpreter lock while it waits.
+    def flush
+      @shards.map do |shard|
+        Thread.new do
+          shard.lock.synchronize do
+            shard.session.declare_exchange(:exchange => "amq.direct", :passive => true)
+            shard.session.process_returned
+          end
+        end
+      end.each { |t| t.join }
+      self
+    end
+
+    # Flush, then close every session and connection.  The stats remain.
+    def close
+      return if @closed
+      begin
+        flush
+      ensure
+        close_shards(@shards)
+      end
+    end
+
+    # Totals over all connections.  :bytes counts :body sizes only, not
+    # encoded :object bodies.
+    def stats
+      { :connections    => @shards.size,
+        :published      => @shards.inject(0) { |sum, shard| sum + shard.published },
+        :bytes          => @shards.inject(0) { |sum, shard| sum + shard.bytes },
+        :throttled_time => @shards.inject(0) { |sum, shard| sum + shard.session.throttled_time },
+        :per_connection => @shards.map { |shard| shard.published } }
+    end
+
+  private
+
+    def shard_for(routing_key)
+      if @route == :hash && routing_key
+        @shards[Zlib.crc32(routing_key.to_s) % @shards.size]
+      else
+        @next_lock.synchronize do
+          @next = (@next + 1) % @shards.size
+          @shards[@next]
+        end
+      end
+    end
+
+    def send_to(shard, args)
+      shard.session.publish(args.dup)
+      shard.published += 1
+      shard.bytes     += args[:body].bytesize if args[:body]
+    end
+
+    def check_open
+      raise AMQDestroyedError.new("Publisher has been closed") if @closed
+    end
+
+    # Close every shard even if some fail, then raise the first failure
+    def close_shards(shards)
+      @closed = true
+      error = nil
+      shards.each do |shard|
+        [shard.session, shard.connection].each do |closing|
+          begin
+            closing.destroy
+          rescue Exception => e
+            error ||= e
+          end
+        end
+      end
+      raise error if error
+    end
+  end
+
   class BasicContent
     def initialize(body, msg_id)
       @content            = RWire::Content.new
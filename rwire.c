@@ -27,18 +27,49 @@
 // POSSIBILITY OF SUCH DAMAGE. */
 
 #include "ruby.h"
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include "ruby/thread.h"
+#endif
+#ifdef HAVE_RUBY_ENCODING_H
+#include "ruby/encoding.h"
+#endif
 #include "wireapi.h"
 #include <dlfcn.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <time.h>
+#include <math.h>
+#include <ctype.h>
+#include <locale.h>
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#include <zlib.h>
+#endif
 
 VALUE eAMQError;
 VALUE eAMQDestroyedError;
+VALUE eAMQRateLimitError;
+VALUE eAMQDecodeError;
 
 VALUE cRWire;
 VALUE cContent;
 VALUE cConnection;
 VALUE cSession;
+VALUE cDispatcher;
+VALUE cPublisher;
+VALUE cCapture;
+VALUE cCaptureReader;
+VALUE cConflator;
+VALUE cDeduplicator;
+VALUE cRateLimiter;
+VALUE cDeadline;
+VALUE cLocalQueue;
+VALUE cPrioritizer;
 
 #define DEF_STRING_SETTER(attr, amq_type) \
 static VALUE rwire_##amq_type##_set_##attr(VALUE self, VALUE attr)\
@@ -100,7 +131,7 @@ static VALUE rwire_##amq_type##_set_##attr(VALUE self, VALUE v)\
 		amq_type##_set_##attr(p, conversion_func(v));\
 	}\
 \
-	return conversion_func(0);\
+	return v;\
 }
 
 #define DEF_CONTENT_BASIC_STRING_ATTR(attr) \
@@ -127,6 +158,19 @@ static VALUE rwire_##amq_type##_set_##attr(VALUE self, VALUE v)\
 	amq_client_connection_t * c;\
 	Data_Get_Struct(self, amq_client_connection_t, c)
 
+#define SESSION_GET_STRUCT(obj, session) \
+	Data_Get_Struct(obj, amq_client_session_t, session);\
+	if (!session)\
+		rb_raise(eAMQDestroyedError, "Session has already been destroyed")
+
+// For a session passed as an argument, which may be one without a WireAPI
+// session behind it, such as a loopback session
+#define SESSION_ARG_GET_STRUCT(obj, session) \
+	if (!rb_obj_is_kind_of(obj, cSession))\
+		rb_raise(rb_eTypeError, "Expected an RWire::Session, not %s (loopback sessions can't be used here)",\
+			rb_obj_classname(obj));\
+	SESSION_GET_STRUCT(obj, session)
+
 #define TO_BOOL(v) (((v) != Qfalse) && !NIL_P(v))
 
 // This malloc a buffer and copy the content of Ruby string into it.	Note
@@ -141,10 +185,110 @@ static char * new_blob_from_rb_str(VALUE rstr)
 	return dest;
 }
 
+// Nanoseconds from an arbitrary point that doesn't move with the wall clock
+static int64_t rwire_monotonic_ns(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	// Mac OS X has no clock_gettime before 10.12
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (int64_t)tv.tv_sec * 1000000000 + (int64_t)tv.tv_usec * 1000;
+#endif
+}
+
+// RWire.monotonic_time, in seconds
+static VALUE rwire_monotonic_time(VALUE self)
+{
+	return rb_float_new(rwire_monotonic_ns() / 1e9);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// Runtime start up and fork handling
+//
+/////////////////////////////////////////////////////////////////////////////
+
+// The WireAPI runtime is started on first use rather than at require time,
+// so that preforking servers which load the extension in the master but
+// only connect in the workers start one runtime per worker, after the fork.
+//
+// The runtime can't be started twice in one process, and the threads of a
+// runtime started before a fork don't survive it, so a child of a process
+// that had started it (by connecting or making a content) can't connect at
+// all: RWire::Connection.new raises AMQError there.
+static bool rwire_runtime_started   = false;
+static bool rwire_runtime_inherited = false;
+
+static void rwire_runtime_ensure(void)
+{
+	if (!rwire_runtime_started) {
+		icl_system_initialise(0, NULL);
+		rwire_runtime_started = true;
+	}
+}
+
+// The connections and sessions of this process.  A forked child shares the
+// sockets of these with its parent, so it must never use or close them.
+typedef struct {
+	VALUE  obj;
+	void * ptr;
+} rwire_owned_t;
+
+static rwire_owned_t * rwire_owned       = NULL;
+static long            rwire_owned_count = 0;
+static long            rwire_owned_size  = 0;
+
+static void rwire_own(VALUE obj, void * ptr)
+{
+	if (rwire_owned_count == rwire_owned_size) {
+		rwire_owned_size = rwire_owned_size ? rwire_owned_size * 2 : 16;
+		rwire_owned = realloc(rwire_owned, rwire_owned_size * sizeof(rwire_owned_t));
+	}
+	rwire_owned[rwire_owned_count].obj = obj;
+	rwire_owned[rwire_owned_count].ptr = ptr;
+	rwire_owned_count++;
+}
+
+static void rwire_disown(void * ptr)
+{
+	long i;
+
+	if (!ptr)
+		return;
+	for (i = 0; i < rwire_owned_count; i++) {
+		if (rwire_owned[i].ptr == ptr) {
+			rwire_owned[i] = rwire_owned[--rwire_owned_count];
+			return;
+		}
+	}
+}
+
+// Runs in the child inside fork(), before fork returns to any Ruby code.
+// Everything still owned was opened by the parent: detach it, leaking the
+// WireAPI objects rather than letting destroy or GC send a close down the
+// parent's sockets.  RWire::Connection then reports dead and RWire::Session
+// raises AMQDestroyedError.
+static void rwire_after_fork_child(void)
+{
+	long i;
+
+	for (i = 0; i < rwire_owned_count; i++)
+		DATA_PTR(rwire_owned[i].obj) = NULL;
+	rwire_owned_count = 0;
+	if (rwire_runtime_started)
+		rwire_runtime_inherited = true;
+}
+
 static VALUE rwire_init(VALUE self, VALUE trace_level)
 {
 	int opt_trace = FIX2INT(trace_level) || 0;
 
+	rwire_runtime_ensure();
+
 	if (opt_trace > 2)
 	{
 		amq_client_connection_animate(TRUE);
@@ -154,9 +298,373 @@ static VALUE rwire_init(VALUE self, VALUE trace_level)
 	return self;
 }
 
+/////////////////////////////////////////////////////////////////////////////
+//
+// Tracing: USDT probes and Ruby hooks
+//
+/////////////////////////////////////////////////////////////////////////////
+
+// The hot paths fire an event at each step.  Each event is a USDT probe in
+// the "rwire" provider (when built with sys/sdt.h) and can also be sampled
+// from Ruby with RWire.hook.  Probes have semaphores, so the clock is only
+// read while a tracer is attached or a hook is set:
+//
+//   bpftrace -e 'usdt:./rwire.so:rwire:publish__done { @ns = hist(arg1); }'
+//
+//   connect        (host, nsecs, failed)
+//   session__open  (nsecs)
+//   publish__start (bytes)
+//   publish__done  (bytes, nsecs)
+//   arrived        (bytes)
+//   body__copy     (bytes, nsecs)
+//   wait__enter    (timeout msecs, 0 for none)
+//   wait__exit     (result, nsecs)
+//   cancel         (consumer tag)
+//
+// Probes fire on the spot.  Hooks for events inside the native helpers
+// (publish, arrived, body copy), which may run under a lock or with
+// contents not yet owned by anything, are only recorded there.  The Ruby
+// method fires them on its way out with RWIRE_HOOKS_FLUSH, once a hook that
+// raises can't leave a lock held or a content leaked.
+
+#ifdef HAVE_SYS_SDT_H
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define RWIRE_PROBE_SEMAPHORE(name) \
+	__extension__ unsigned short rwire_##name##_semaphore \
+		__attribute__((unused, section(".probes"), visibility("hidden")))
+#define RWIRE_PROBE_ENABLED(name) __builtin_expect(rwire_##name##_semaphore, 0)
+#define RWIRE_PROBE1(name, a)       STAP_PROBE1(rwire, name, a)
+#define RWIRE_PROBE2(name, a, b)    STAP_PROBE2(rwire, name, a, b)
+#define RWIRE_PROBE3(name, a, b, c) STAP_PROBE3(rwire, name, a, b, c)
+#else
+#define RWIRE_PROBE_SEMAPHORE(name) extern int rwire_no_##name##_semaphore
+#define RWIRE_PROBE_ENABLED(name)   0
+#define RWIRE_PROBE1(name, a)       do {} while (0)
+#define RWIRE_PROBE2(name, a, b)    do {} while (0)
+#define RWIRE_PROBE3(name, a, b, c) do {} while (0)
+#endif
+
+RWIRE_PROBE_SEMAPHORE(connect);
+RWIRE_PROBE_SEMAPHORE(session__open);
+RWIRE_PROBE_SEMAPHORE(publish__start);
+RWIRE_PROBE_SEMAPHORE(publish__done);
+RWIRE_PROBE_SEMAPHORE(arrived);
+RWIRE_PROBE_SEMAPHORE(body__copy);
+RWIRE_PROBE_SEMAPHORE(wait__enter);
+RWIRE_PROBE_SEMAPHORE(wait__exit);
+RWIRE_PROBE_SEMAPHORE(cancel);
+
+enum {
+	RWIRE_EV_CONNECT,
+	RWIRE_EV_SESSION_OPEN,
+	RWIRE_EV_PUBLISH_START,
+	RWIRE_EV_PUBLISH_DONE,
+	RWIRE_EV_ARRIVED,
+	RWIRE_EV_BODY_COPY,
+	RWIRE_EV_WAIT_ENTER,
+	RWIRE_EV_WAIT_EXIT,
+	RWIRE_EV_CANCEL,
+	RWIRE_EV_COUNT
+};
+
+static const char * rwire_event_names[RWIRE_EV_COUNT] = {
+	"connect", "session_open", "publish_start", "publish_done", "arrived",
+	"body_copy", "wait_enter", "wait_exit", "cancel"
+};
+
+static unsigned int  rwire_hooked = 0;            // Bit per hooked event
+static VALUE         rwire_hooks = Qnil;          // Blocks by event
+static long          rwire_hook_every[RWIRE_EV_COUNT];
+static unsigned long rwire_hook_seen[RWIRE_EV_COUNT];
+
+// An event recorded for its hook
+typedef struct {
+	int     ev;
+	int     argc;
+	int64_t a;
+	int64_t b;
+} rwire_event_t;
+
+// Per thread: whether a hook is running (events inside a hook aren't hooked)
+// and the recorded events still to be fired
+typedef struct {
+	bool            in_hook;
+	long            fired;
+	long            count;
+	long            size;
+	rwire_event_t * events;
+} rwire_trace_state_t;
+
+static pthread_key_t rwire_trace_key;
+
+static void rwire_trace_state_free(void *p)
+{
+	rwire_trace_state_t * t = (rwire_trace_state_t *)p;
+
+	free(t->events);
+	free(t);
+}
+
+static rwire_trace_state_t * rwire_trace_state(void)
+{
+	rwire_trace_state_t * t = pthread_getspecific(rwire_trace_key);
+
+	if (!t) {
+		t = calloc(1, sizeof(rwire_trace_state_t));
+		pthread_setspecific(rwire_trace_key, t);
+	}
+	return t;
+}
+
+// Is anyone listening for an event, the probe or a hook?
+#define RWIRE_TRACED(probe, ev) \
+	(RWIRE_PROBE_ENABLED(probe) || (rwire_hooked & (1u << (ev))))
+
+// Start timing an event: 0 if nobody is listening
+#define RWIRE_TRACE_START(probe, ev) \
+	(RWIRE_TRACED(probe, ev) ? rwire_monotonic_ns() : 0)
+
+typedef struct {
+	VALUE block;
+	VALUE a;
+	VALUE b;
+} rwire_hook_call_t;
+
+static VALUE rwire_hook_call(VALUE p)
+{
+	rwire_hook_call_t * call = (rwire_hook_call_t *)p;
+	return rb_funcall(call->block, rb_intern("call"), 2, call->a, call->b);
+}
+
+static VALUE rwire_hook_done(VALUE p)
+{
+	((rwire_trace_state_t *)p)->in_hook = false;
+	return Qnil;
+}
+
+// Is this occurrence of the event one its hook wants to see?  Counts it
+// towards the hook's sampling.
+static rwire_trace_state_t * rwire_hook_sampled(int ev)
+{
+	rwire_trace_state_t * t;
+
+	if (!(rwire_hooked & (1u << ev)))
+		return NULL;
+	t = rwire_trace_state();
+	if (t->in_hook || ++rwire_hook_seen[ev] % rwire_hook_every[ev])
+		return NULL;
+	return t;
+}
+
+static void rwire_hook_call_now(rwire_trace_state_t *t, int ev, VALUE a, VALUE b)
+{
+	rwire_hook_call_t call;
+
+	call.block = rb_ary_entry(rwire_hooks, ev);
+	if (NIL_P(call.block))
+		return;
+	call.a     = a;
+	call.b     = b;
+	t->in_hook = true;
+	rb_ensure(rwire_hook_call, (VALUE)&call, rwire_hook_done, (VALUE)t);
+}
+
+// Call the hook for an event, every so many times.  Only for callers that
+// hold no lock and own everything they have made.
+static void rwire_hook_fire(int ev, VALUE a, VALUE b)
+{
+	rwire_trace_state_t * t = rwire_hook_sampled(ev);
+
+	if (t)
+		rwire_hook_call_now(t, ev, a, b);
+}
+
+// Record an event for its hook, to be called by RWIRE_HOOKS_FLUSH.  Doesn't
+// touch Ruby, so it's safe anywhere the interpreter lock is held.
+static void rwire_hook_record(int ev, int argc, int64_t a, int64_t b)
+{
+	rwire_trace_state_t * t = rwire_hook_sampled(ev);
+
+	if (!t)
+		return;
+	if (t->count == t->size) {
+		t->size   = t->size ? t->size * 2 : 16;
+		t->events = realloc(t->events, t->size * sizeof(rwire_event_t));
+	}
+	t->events[t->count].ev   = ev;
+	t->events[t->count].argc = argc;
+	t->events[t->count].a    = a;
+	t->events[t->count].b    = b;
+	t->count++;
+}
+
+// Call the hooks for the events this thread has recorded.  If one raises,
+// the events after it are still called by the next flush.
+static void rwire_hooks_flush(void)
+{
+	rwire_trace_state_t * t = pthread_getspecific(rwire_trace_key);
+	rwire_event_t e;
+
+	if (!t || t->in_hook)
+		return;
+	while (t->fired < t->count) {
+		e = t->events[t->fired++];
+		if (t->fired == t->count)
+			t->fired = t->count = 0;
+		rwire_hook_call_now(t, e.ev, LL2NUM(e.a), e.argc > 1 ? LL2NUM(e.b) : Qnil);
+	}
+}
+
+#define RWIRE_HOOKS_FLUSH() \
+	do { if (rwire_hooked) rwire_hooks_flush(); } while (0)
+
+static VALUE rwire_hooks_flush_protected(VALUE p)
+{
+	rwire_hooks_flush();
+	return Qnil;
+}
+
+// Event number for a Symbol
+static int rwire_event_find(VALUE event)
+{
+	int ev;
+
+	Check_Type(event, T_SYMBOL);
+	for (ev = 0; ev < RWIRE_EV_COUNT; ev++) {
+		if (SYM2ID(event) == rb_intern(rwire_event_names[ev]))
+			return ev;
+	}
+	rb_raise(rb_eArgError, "Unknown event :%s", rb_id2name(SYM2ID(event)));
+	return -1;
+}
+
+// RWire.hook(event, every = 1) { |a, b| ... }: call the block with the
+// event's values (see above; nsecs for session_open) every so many times
+// the event happens.  Replaces any earlier hook for the event.
+static VALUE rwire_hook(int argc, VALUE *argv, VALUE self)
+{
+	VALUE event, every, block;
+	long  _every;
+	int   ev;
+
+	rb_scan_args(argc, argv, "11&", &event, &every, &block);
+	ev = rwire_event_find(event);
+	_every = NIL_P(every) ? 1 : NUM2LONG(every);
+	if (_every < 1)
+		rb_raise(rb_eArgError, "Hooks are called at least every 1 event");
+	if (NIL_P(block))
+		rb_raise(rb_eArgError, "RWire.hook needs a block");
+
+	rb_ary_store(rwire_hooks, ev, block);
+	rwire_hook_every[ev] = _every;
+	rwire_hook_seen[ev]  = 0;
+	rwire_hooked |= 1u << ev;
+
+	return event;
+}
+
+// RWire.unhook(event), or every event without one
+static VALUE rwire_unhook(int argc, VALUE *argv, VALUE self)
+{
+	VALUE event;
+	int   ev;
+
+	rb_scan_args(argc, argv, "01", &event);
+	if (NIL_P(event)) {
+		rwire_hooked = 0;
+		rb_ary_clear(rwire_hooks);
+	}
+	else {
+		ev = rwire_event_find(event);
+		rwire_hooked &= ~(1u << ev);
+		rb_ary_store(rwire_hooks, ev, Qnil);
+	}
+	return Qnil;
+}
+
+// RWire.hooks: the events with hooks
+static VALUE rwire_get_hooks(VALUE self)
+{
+	VALUE events = rb_ary_new();
+	int   ev;
+
+	for (ev = 0; ev < RWIRE_EV_COUNT; ev++) {
+		if (rwire_hooked & (1u << ev))
+			rb_ary_push(events, ID2SYM(rb_intern(rwire_event_names[ev])));
+	}
+	return events;
+}
+
+// RWire.events: every event that can be hooked
+static VALUE rwire_get_events(VALUE self)
+{
+	VALUE events = rb_ary_new();
+	int   ev;
+
+	for (ev = 0; ev < RWIRE_EV_COUNT; ev++)
+		rb_ary_push(events, ID2SYM(rb_intern(rwire_event_names[ev])));
+	return events;
+}
+
+// basic_publish, traced.  The traced helpers record hook events; the Ruby
+// method calling them fires those with RWIRE_HOOKS_FLUSH.
+static int rwire_basic_publish(amq_client_session_t *session, amq_content_basic_t *content,
+	char *exchange, char *routing_key, bool mandatory, bool immediate)
+{
+	int64_t bytes = 0, started, took;
+	int     rc;
+
+	if (RWIRE_TRACED(publish__start, RWIRE_EV_PUBLISH_START)) {
+		bytes = amq_content_basic_get_body_size(content);
+		RWIRE_PROBE1(publish__start, bytes);
+		rwire_hook_record(RWIRE_EV_PUBLISH_START, 1, bytes, 0);
+	}
+
+	started = RWIRE_TRACE_START(publish__done, RWIRE_EV_PUBLISH_DONE);
+	rc = amq_client_session_basic_publish(session, content, 0, exchange, routing_key,
+		mandatory, immediate);
+	if (started) {
+		took  = rwire_monotonic_ns() - started;
+		bytes = amq_content_basic_get_body_size(content);
+		RWIRE_PROBE2(publish__done, bytes, took);
+		rwire_hook_record(RWIRE_EV_PUBLISH_DONE, 2, bytes, took);
+	}
+	return rc;
+}
+
+// basic_arrived, traced
+static amq_content_basic_t * rwire_basic_arrived(amq_client_session_t *session)
+{
+	amq_content_basic_t * content = amq_client_session_basic_arrived(session);
+	int64_t bytes;
+
+	if (content && RWIRE_TRACED(arrived, RWIRE_EV_ARRIVED)) {
+		bytes = amq_content_basic_get_body_size(content);
+		RWIRE_PROBE1(arrived, bytes);
+		rwire_hook_record(RWIRE_EV_ARRIVED, 1, bytes, 0);
+	}
+	return content;
+}
+
+// Copy size bytes of body out of a content, traced
+static void rwire_copy_body(amq_content_basic_t *content, char *buf, int64_t size)
+{
+	int64_t started = RWIRE_TRACE_START(body__copy, RWIRE_EV_BODY_COPY);
+	int64_t took;
+
+	amq_content_basic_get_body(content, (byte *)buf, size);
+	if (started) {
+		took = rwire_monotonic_ns() - started;
+		RWIRE_PROBE2(body__copy, size, took);
+		rwire_hook_record(RWIRE_EV_BODY_COPY, 2, size, took);
+	}
+}
+
 static void rwire_connection_free(void * p)
 {
 	amq_client_connection_t * c = (amq_client_connection_t *)p;
+	rwire_disown(c);
 	if (c) {
 		fprintf(stderr, "AMQ connection not destroyed yet, calling destroy\n");
 		amq_client_connection_destroy(&c);
@@ -173,6 +681,26 @@ static VALUE rwire_connection_alloc(VALUE klass)
 	return Data_Wrap_Struct(cConnection, 0, rwire_connection_free, c);
 }
 
+// The arguments of amq_client_connection_new, for connecting without the GVL
+typedef struct {
+	char                    * host;
+	char                    * vhost;
+	icl_longstr_t           * auth_data;
+	char                    * client_name;
+	int                       trace;
+	int                       timeout;
+	amq_client_connection_t * connection;
+} rwire_connect_t;
+
+static void * rwire_connect_blocking(void *p)
+{
+	rwire_connect_t *c = (rwire_connect_t *)p;
+
+	c->connection = amq_client_connection_new(c->host, c->vhost, c->auth_data,
+		c->client_name, c->trace, c->timeout);
+	return NULL;
+}
+
 static VALUE rwire_connection_init(
 	VALUE self,
 	VALUE host,
@@ -183,28 +711,54 @@ static VALUE rwire_connection_init(
 	VALUE trace,
 	VALUE timeout)
 {
-	icl_longstr_t *auth_data;
-	char *_hostname    = StringValuePtr(host);
-	char *_vhost       = StringValuePtr(vhost);
-	char *_client_name = StringValuePtr(client_name);
-	char *_username    = StringValuePtr(username);
-	char *_password    = StringValuePtr(password);;
+	rwire_connect_t conn;
+	char *_username = StringValuePtr(username);
+	char *_password = StringValuePtr(password);
+	int64_t started, took;
+
+	// Frozen copies, so that no other thread can change the strings while
+	// we connect without the GVL
+	host        = rb_str_new_frozen(StringValue(host));
+	vhost       = rb_str_new_frozen(StringValue(vhost));
+	client_name = rb_str_new_frozen(StringValue(client_name));
+
+	if (rwire_runtime_inherited)
+		rb_raise(eAMQError, "Can't connect in a child forked after the WireAPI runtime started; connect only after forking");
+	rwire_runtime_ensure();
+	started = RWIRE_TRACE_START(connect, RWIRE_EV_CONNECT);
 
 	//  Open all connections
-	auth_data = amq_client_connection_auth_plain(_username, _password);
-	amq_client_connection_t * c = amq_client_connection_new(
-				_hostname,
-				_vhost,
-				auth_data,
-				_client_name,
-				FIX2INT(trace),
-				FIX2INT(timeout));
+	conn.host        = StringValueCStr(host);
+	conn.vhost       = StringValueCStr(vhost);
+	conn.client_name = StringValueCStr(client_name);
+	conn.auth_data   = amq_client_connection_auth_plain(_username, _password);
+	conn.trace       = FIX2INT(trace);
+	conn.timeout     = FIX2INT(timeout);
+	conn.connection  = NULL;
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+	// Connecting is mostly waiting on the broker; let other threads run,
+	// including other threads connecting
+	rb_thread_call_without_gvl(rwire_connect_blocking, &conn, NULL, NULL);
+#else
+	rwire_connect_blocking(&conn);
+#endif
+	amq_client_connection_t * c = conn.connection;
+
+	if (c) {
+		DATA_PTR(self) = c;
+		rwire_own(self, c);
+	}
+
+	if (started) {
+		took = rwire_monotonic_ns() - started;
+		RWIRE_PROBE3(connect, conn.host, took, c == NULL);
+		rwire_hook_fire(RWIRE_EV_CONNECT, host, LL2NUM(took));
+	}
 
 	if (!c)
 		rb_raise(eAMQError, "Failed to connect to AMQ broker");
 
-	DATA_PTR(self) = c;
-
 	return self;
 }
 
@@ -226,7 +780,10 @@ static void rwire_amq_content_basic_free(void *p)
 
 static VALUE rwire_amq_content_basic_alloc(VALUE klass)
 {
-	amq_content_basic_t * content = amq_content_basic_new();
+	amq_content_basic_t * content = NULL;
+
+	rwire_runtime_ensure();
+	content = amq_content_basic_new();
 	if (!content)
 		rb_raise(rb_eRuntimeError, "Failed to create content object");
 	VALUE rb_content = Data_Wrap_Struct(klass, 0, rwire_amq_content_basic_free, content);
@@ -259,6 +816,78 @@ static VALUE rwire_amq_content_basic_set_body(VALUE self, VALUE value)
 	return self;
 }
 
+// Set where the content says it was published to.  The broker does this for
+// delivered contents; the loopback transport does it itself.
+static VALUE rwire_amq_content_basic_set_routing_key(VALUE self, VALUE exchange, VALUE routing_key)
+{
+	amq_content_basic_t * content = NULL;
+	char * _exchange    = NIL_P(exchange) ? "" : StringValuePtr(exchange);
+	char * _routing_key = NIL_P(routing_key) ? "" : StringValuePtr(routing_key);
+
+	Data_Get_Struct(self, amq_content_basic_t, content);
+	if (amq_content_basic_set_routing_key(content, _exchange, _routing_key, 0)) {
+		rb_raise(eAMQError, "Failed to set routing key");
+	}
+	return self;
+}
+
+// Copy a string property only if it is set
+#define RWIRE_COPY_PROPERTY(copy, content, attr) \
+	if (amq_content_basic_get_##attr(content) && *amq_content_basic_get_##attr(content))\
+		amq_content_basic_set_##attr(copy, amq_content_basic_get_##attr(content))
+
+// A new content with the body, properties, headers and routing of this one,
+// for handing a message to more than one owner
+static amq_content_basic_t * rwire_content_copy(amq_content_basic_t *content)
+{
+	amq_content_basic_t * copy = NULL;
+	int64_t size;
+	char  * body;
+
+	size = amq_content_basic_get_body_size(content);
+	body = malloc(size ? size : 1);
+	rwire_copy_body(content, body, size);
+
+	copy = amq_content_basic_new();
+	amq_content_basic_set_body(copy, body, size, free);
+	RWIRE_COPY_PROPERTY(copy, content, app_id);
+	RWIRE_COPY_PROPERTY(copy, content, content_encoding);
+	RWIRE_COPY_PROPERTY(copy, content, content_type);
+	RWIRE_COPY_PROPERTY(copy, content, correlation_id);
+	RWIRE_COPY_PROPERTY(copy, content, expiration);
+	RWIRE_COPY_PROPERTY(copy, content, message_id);
+	RWIRE_COPY_PROPERTY(copy, content, reply_to);
+	RWIRE_COPY_PROPERTY(copy, content, user_id);
+	amq_content_basic_set_delivery_mode(copy, amq_content_basic_get_delivery_mode(content));
+	amq_content_basic_set_priority(copy, amq_content_basic_get_priority(content));
+	amq_content_basic_set_timestamp(copy, amq_content_basic_get_timestamp(content));
+	if (amq_content_basic_get_headers(content))
+		amq_content_basic_set_headers(copy, amq_content_basic_get_headers(content));
+	if (amq_content_basic_get_exchange(content) || amq_content_basic_get_routing_key(content)) {
+		amq_content_basic_set_routing_key(copy,
+			amq_content_basic_get_exchange(content) ? amq_content_basic_get_exchange(content) : "",
+			amq_content_basic_get_routing_key(content) ? amq_content_basic_get_routing_key(content) : "",
+			0);
+	}
+
+	return copy;
+}
+
+static VALUE rwire_amq_content_basic_copy(VALUE self)
+{
+	amq_content_basic_t * content = NULL;
+	VALUE r_copy;
+
+	Data_Get_Struct(self, amq_content_basic_t, content);
+	if (!content)
+		rb_raise(eAMQDestroyedError, "Content has already been unlinked");
+
+	r_copy = Data_Wrap_Struct(cContent, 0, rwire_amq_content_basic_free,
+		rwire_content_copy(content));
+	RWIRE_HOOKS_FLUSH();
+	return r_copy;
+}
+
 static VALUE rwire_amq_content_basic_get_body(VALUE self)
 {
 	amq_content_basic_t * content = NULL;
@@ -271,9 +900,11 @@ static VALUE rwire_amq_content_basic_get_body(VALUE self)
 	if (content) {
 		size = amq_content_basic_get_body_size(content);
 		_value = malloc(size+1);
-		amq_content_basic_get_body(content, (byte *)_value, size);
+		rwire_copy_body(content, _value, size);
 		_value[size] = '\0';
 		result = rb_str_new(_value, size);
+		free(_value);
+		RWIRE_HOOKS_FLUSH();
 	}
 	else {
 		result = rb_str_new2("");
@@ -282,6 +913,14 @@ static VALUE rwire_amq_content_basic_get_body(VALUE self)
 	return result;
 }
 
+// Sessions are only destroyed explicitly, so GC just forgets them
+static void rwire_amq_client_session_free(void * p)
+{
+	rwire_disown(p);
+}
+
+static VALUE rwire_amq_client_session_destroy(VALUE self);
+
 static VALUE rwire_amq_client_session_new(VALUE self)
 {
 	amq_client_connection_t *connection = NULL;
@@ -292,11 +931,32 @@ static VALUE rwire_amq_client_session_new(VALUE self)
 
 	if (connection)
 	{
+		int64_t started = RWIRE_TRACE_START(session__open, RWIRE_EV_SESSION_OPEN);
+		int64_t took;
+		int     state = 0;
+
 		session = amq_client_session_new (connection);
-		if (!session)
+		if (started) {
+			took = rwire_monotonic_ns() - started;
+			RWIRE_PROBE1(session__open, took);
+			rwire_hook_record(RWIRE_EV_SESSION_OPEN, 1, took, 0);
+		}
+		if (!session) {
+			RWIRE_HOOKS_FLUSH();
 			rb_raise(eAMQError, "Failed to start a new session");
+		}
+
+		rb_session = Data_Wrap_Struct(cSession, 0, rwire_amq_client_session_free, session);
+		rwire_own(rb_session, session);
 
-		rb_session = Data_Wrap_Struct(cSession, 0, 0, session);
+		// GC doesn't destroy sessions, so one a hook keeps from the caller
+		// has to go here
+		if (rwire_hooked)
+			rb_protect(rwire_hooks_flush_protected, Qnil, &state);
+		if (state) {
+			rwire_amq_client_session_destroy(rb_session);
+			rb_jump_tag(state);
+		}
 	}
 	else
 		rb_raise(rb_eRuntimeError, "Server connection is dead");
@@ -312,6 +972,7 @@ DEF_CONTENT_BASIC_STRING_ATTR(content_type)
 DEF_CONTENT_BASIC_STRING_ATTR(correlation_id)
 DEF_CONTENT_BASIC_INT_GETTER(delivery_mode, INT2NUM)
 DEF_CONTENT_BASIC_INT_SETTER(delivery_mode, NUM2INT)
+DEF_CONTENT_BASIC_INT_GETTER(delivery_tag, LL2NUM)
 DEF_STRING_GETTER(exchange,    amq_content_basic)
 DEF_CONTENT_BASIC_STRING_ATTR(expiration)
 DEF_CONTENT_BASIC_STRING_ATTR(message_id)
@@ -325,483 +986,4723 @@ DEF_CONTENT_BASIC_STRING_ATTR(user_id)
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// Functions for RWire::Connection
+// Body codecs: MessagePack and JSON
 //
 /////////////////////////////////////////////////////////////////////////////
-static VALUE rwire_connection_destroy(VALUE self)
+
+// Content#encode_body writes a Ruby object straight into a malloc'ed buffer
+// that becomes the content body, and Content#decode_body builds Ruby objects
+// straight from the body bytes, so neither goes through an intermediate
+// Ruby String.  Both handle nil, true, false, Integer, Float, String, Symbol
+// (as a string), Array and Hash.
+
+#define RWIRE_CODEC_MAX_DEPTH 512
+
+#define RWIRE_MSGPACK_TYPE "application/x-msgpack"
+#define RWIRE_JSON_TYPE    "application/json"
+
+#ifndef RHASH_SIZE
+#define RHASH_SIZE(h) (RHASH(h)->tbl->num_entries)
+#endif
+
+enum {
+	RWIRE_CODEC_MSGPACK,
+	RWIRE_CODEC_JSON
+};
+
+typedef struct {
+	char * ptr;
+	size_t len;
+	size_t size;
+	int    depth;
+} rwire_buf_t;
+
+static void rwire_buf_reserve(rwire_buf_t * b, size_t n)
 {
-	CONNECTION_GET;
-	if (c) {
-		amq_client_connection_destroy((amq_client_connection_t**)&(DATA_PTR(self)));
+	if (b->len + n > b->size) {
+		size_t size = b->size ? b->size : 256;
+		while (size < b->len + n)
+			size *= 2;
+		char * ptr = realloc(b->ptr, size);
+		if (!ptr)
+			rb_raise(rb_eNoMemError, "Failed to grow the body buffer");
+		b->ptr  = ptr;
+		b->size = size;
 	}
-	return self;
 }
 
-static VALUE rwire_amq_client_connection_get_alive(VALUE self)
+static void rwire_buf_append(rwire_buf_t * b, const void * p, size_t n)
 {
-	CONNECTION_GET;
-	if (c) {
-		return amq_client_connection_get_alive(c) ? Qtrue : Qfalse;
-	}
-	return Qfalse;
+	rwire_buf_reserve(b, n);
+	memcpy(b->ptr + b->len, p, n);
+	b->len += n;
 }
 
-static VALUE rwire_amq_client_connection_get_silent(VALUE self)
+static void rwire_buf_byte(rwire_buf_t * b, int c)
 {
-	CONNECTION_GET;
-	if (!c) {
-		rb_raise(eAMQDestroyedError, "Connection has aleady been destroyed");
-	}
-	return amq_client_connection_get_silent(c) ? Qtrue : Qfalse;
+	rwire_buf_reserve(b, 1);
+	b->ptr[b->len++] = (char)c;
 }
 
-static VALUE rwire_amq_client_connection_set_silent(VALUE self, VALUE silent)
+// Append the big endian bytes of v, the low n bytes
+static void rwire_buf_be(rwire_buf_t * b, int marker, uint64_t v, int n)
 {
-	CONNECTION_GET;
-	if (!c) {
-		rb_raise(eAMQDestroyedError, "Connection has aleady been destroyed");
-	}
-	return amq_client_connection_set_silent(c, silent);
+	rwire_buf_reserve(b, n + 1);
+	if (marker >= 0)
+		b->ptr[b->len++] = (char)marker;
+	while (n--)
+		b->ptr[b->len++] = (char)(v >> (n * 8));
 }
 
-DEF_CLIENT_CONNECTION_INT_GETTER(channel_max, UINT2NUM)
-DEF_CLIENT_CONNECTION_INT_GETTER(class_id, INT2FIX)
-DEF_STRING_GETTER(error_text, amq_client_connection)
-DEF_CLIENT_CONNECTION_INT_GETTER(frame_max, ULONG2NUM)
-DEF_CLIENT_CONNECTION_INT_GETTER(heartbeat, INT2FIX)
-DEF_STRING_GETTER(known_hosts, amq_client_connection)
-DEF_CLIENT_CONNECTION_INT_GETTER(method_id, INT2FIX)
-DEF_CLIENT_CONNECTION_INT_GETTER(reply_code, INT2FIX)
-DEF_STRING_GETTER(reply_text, amq_client_connection)
-DEF_CLIENT_CONNECTION_INT_GETTER(version_major, CHR2FIX)
-DEF_CLIENT_CONNECTION_INT_GETTER(version_minor, CHR2FIX)
-
-/////////////////////////////////////////////////////////////////////////////
-//
-// Functions for RWire::Session
-//
-/////////////////////////////////////////////////////////////////////////////
+static bool rwire_str_is_binary(VALUE str)
+{
+#ifdef HAVE_RUBY_ENCODING_H
+	return ENCODING_GET(str) == rb_ascii8bit_encindex();
+#else
+	return false;
+#endif
+}
 
-static VALUE rwire_amq_client_session_get_error_text(VALUE self)
+static VALUE rwire_utf8_str_new(const char * p, long n)
 {
-    amq_client_session_t *session = NULL;
-    Data_Get_Struct(self, amq_client_session_t, session);
-    return rb_str_new2(session->error_text);
+#ifdef HAVE_RUBY_ENCODING_H
+	return rb_enc_str_new(p, n, rb_utf8_encoding());
+#else
+	return rb_str_new(p, n);
+#endif
 }
 
-static VALUE rwire_amq_client_session_get_reply_text(VALUE self)
+// JSON text and MessagePack str are UTF-8.  Strings in other encodings are
+// transcoded, and binary or broken strings raise rather than turn into
+// invalid text.  Without encodings (Ruby 1.8) the bytes go out as they are.
+static VALUE rwire_codec_utf8(VALUE str, const char * format)
 {
-    amq_client_session_t *session = NULL;
-    Data_Get_Struct(self, amq_client_session_t, session);
-    return rb_str_new2(session->reply_text);
+#ifdef HAVE_RUBY_ENCODING_H
+	int enc = ENCODING_GET(str);
+	int cr;
+
+	if (enc != rb_utf8_encindex() && enc != rb_usascii_encindex() &&
+		enc != rb_ascii8bit_encindex())
+		return rb_str_encode(str, rb_enc_from_encoding(rb_utf8_encoding()), 0, Qnil);
+
+	cr = rb_enc_str_coderange(str);
+	if (cr == ENC_CODERANGE_7BIT)
+		return str;
+	if (enc == rb_ascii8bit_encindex())
+		rb_raise(rb_eArgError, "Can't encode a binary String as %s", format);
+	if (cr == ENC_CODERANGE_BROKEN)
+		rb_raise(rb_eArgError, "Can't encode a String with invalid %s as %s",
+			rb_enc_name(rb_enc_from_index(enc)), format);
+#endif
+	return str;
 }
 
-static VALUE rwire_amq_client_session_get_reply_code(VALUE self)
+// The name of a Symbol as a String, in its own encoding
+static VALUE rwire_codec_sym_str(VALUE sym)
 {
-    amq_client_session_t *session = NULL;
-    Data_Get_Struct(self, amq_client_session_t, session);
-    return INT2FIX(session->reply_code);
+#ifdef HAVE_RUBY_ENCODING_H
+	return rb_id2str(SYM2ID(sym));
+#else
+	return rb_str_new2(rb_id2name(SYM2ID(sym)));
+#endif
 }
 
-static VALUE rwire_amq_client_session_get_queue(VALUE self)
+static void rwire_codec_enter(rwire_buf_t * b)
 {
-    amq_client_session_t *session = NULL;
-    Data_Get_Struct(self, amq_client_session_t, session);
-    return rb_str_new2(session->queue);
+	if (++b->depth > RWIRE_CODEC_MAX_DEPTH)
+		rb_raise(rb_eArgError, "Object nested too deeply to encode (circular?)");
 }
 
-static VALUE rwire_amq_client_session_get_exchange(VALUE self)
+//
+// MessagePack
+//
+
+static void rwire_msgpack_encode(rwire_buf_t * b, VALUE obj);
+
+static int rwire_msgpack_encode_pair(VALUE key, VALUE value, VALUE p)
 {
-    amq_client_session_t *session = NULL;
-    Data_Get_Struct(self, amq_client_session_t, session);
-    return rb_str_new2(session->exchange);
+	rwire_buf_t * b = (rwire_buf_t *)p;
+	rwire_msgpack_encode(b, key);
+	rwire_msgpack_encode(b, value);
+	return ST_CONTINUE;
 }
 
-static VALUE rwire_amq_client_session_get_message_count(VALUE self)
+static void rwire_msgpack_encode_str(rwire_buf_t * b, const char * p, long n, bool binary)
 {
-    amq_client_session_t *session = NULL;
-    Data_Get_Struct(self, amq_client_session_t, session);
-    return INT2FIX(session->message_count);
+	if (binary) {
+		if (n < 0x100)
+			rwire_buf_be(b, 0xc4, n, 1);
+		else if (n < 0x10000)
+			rwire_buf_be(b, 0xc5, n, 2);
+		else
+			rwire_buf_be(b, 0xc6, n, 4);
+	}
+	else {
+		if (n < 32)
+			rwire_buf_byte(b, 0xa0 | (int)n);
+		else if (n < 0x100)
+			rwire_buf_be(b, 0xd9, n, 1);
+		else if (n < 0x10000)
+			rwire_buf_be(b, 0xda, n, 2);
+		else
+			rwire_buf_be(b, 0xdb, n, 4);
+	}
+	rwire_buf_append(b, p, n);
 }
 
-static VALUE rwire_amq_client_session_destroy(VALUE self)
+static void rwire_msgpack_encode_int(rwire_buf_t * b, int64_t v)
 {
-    amq_client_session_t *session = NULL;
-    Data_Get_Struct(self, amq_client_session_t, session);
-    amq_client_session_destroy(&session);
-    return Qnil;
+	if (v >= 0) {
+		if (v < 0x80)
+			rwire_buf_byte(b, (int)v);
+		else if (v < 0x100)
+			rwire_buf_be(b, 0xcc, v, 1);
+		else if (v < 0x10000)
+			rwire_buf_be(b, 0xcd, v, 2);
+		else if (v < 0x100000000LL)
+			rwire_buf_be(b, 0xce, v, 4);
+		else
+			rwire_buf_be(b, 0xcf, v, 8);
+	}
+	else {
+		if (v >= -32)
+			rwire_buf_byte(b, (int)(v & 0xff));
+		else if (v >= -0x80)
+			rwire_buf_be(b, 0xd0, v, 1);
+		else if (v >= -0x8000)
+			rwire_buf_be(b, 0xd1, v, 2);
+		else if (v >= -0x80000000LL)
+			rwire_buf_be(b, 0xd2, v, 4);
+		else
+			rwire_buf_be(b, 0xd3, v, 8);
+	}
 }
 
-static VALUE rwire_amq_client_session_wait(VALUE self, VALUE timeout)
+static void rwire_msgpack_encode(rwire_buf_t * b, VALUE obj)
+{
+	union { double d; uint64_t u; } f;
+	long i, n;
+
+	switch (TYPE(obj)) {
+	case T_NIL:
+		rwire_buf_byte(b, 0xc0);
+		break;
+	case T_FALSE:
+		rwire_buf_byte(b, 0xc2);
+		break;
+	case T_TRUE:
+		rwire_buf_byte(b, 0xc3);
+		break;
+	case T_FIXNUM:
+		rwire_msgpack_encode_int(b, FIX2LONG(obj));
+		break;
+	case T_BIGNUM:
+		if (RTEST(rb_funcall(obj, rb_intern("<"), 1, INT2FIX(0))))
+			rwire_msgpack_encode_int(b, rb_big2ll(obj));
+		else
+			rwire_buf_be(b, 0xcf, rb_big2ull(obj), 8);
+		break;
+	case T_FLOAT:
+		f.d = RFLOAT_VALUE(obj);
+		rwire_buf_be(b, 0xcb, f.u, 8);
+		break;
+	case T_STRING:
+		// Binary Strings go out as bin, everything else as UTF-8 str
+		if (rwire_str_is_binary(obj)) {
+			rwire_msgpack_encode_str(b, RSTRING_PTR(obj), RSTRING_LEN(obj), true);
+			break;
+		}
+		obj = rwire_codec_utf8(obj, "MessagePack");
+		rwire_msgpack_encode_str(b, RSTRING_PTR(obj), RSTRING_LEN(obj), false);
+		break;
+	case T_SYMBOL:
+		obj = rwire_codec_utf8(rwire_codec_sym_str(obj), "MessagePack");
+		rwire_msgpack_encode_str(b, RSTRING_PTR(obj), RSTRING_LEN(obj), false);
+		break;
+	case T_ARRAY:
+		rwire_codec_enter(b);
+		n = RARRAY_LEN(obj);
+		if (n < 16)
+			rwire_buf_byte(b, 0x90 | (int)n);
+		else if (n < 0x10000)
+			rwire_buf_be(b, 0xdc, n, 2);
+		else
+			rwire_buf_be(b, 0xdd, n, 4);
+		for (i = 0; i < n; i++)
+			rwire_msgpack_encode(b, rb_ary_entry(obj, i));
+		b->depth--;
+		break;
+	case T_HASH:
+		rwire_codec_enter(b);
+		n = RHASH_SIZE(obj);
+		if (n < 16)
+			rwire_buf_byte(b, 0x80 | (int)n);
+		else if (n < 0x10000)
+			rwire_buf_be(b, 0xde, n, 2);
+		else
+			rwire_buf_be(b, 0xdf, n, 4);
+		rb_hash_foreach(obj, rwire_msgpack_encode_pair, (VALUE)b);
+		b->depth--;
+		break;
+	default:
+		rb_raise(rb_eTypeError, "Can't encode %s as MessagePack", rb_obj_classname(obj));
+	}
+}
+
+//
+// JSON
+//
+
+static void rwire_json_encode(rwire_buf_t * b, VALUE obj);
+
+static void rwire_json_encode_str(rwire_buf_t * b, const char * p, long n)
+{
+	static const char hex[] = "0123456789abcdef";
+	long i, start = 0;
+	unsigned char c;
+
+	rwire_buf_byte(b, '"');
+	for (i = 0; i < n; i++) {
+		c = (unsigned char)p[i];
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+
+		rwire_buf_append(b, p + start, i - start);
+		start = i + 1;
+		switch (c) {
+		case '"':  rwire_buf_append(b, "\\\"", 2); break;
+		case '\\': rwire_buf_append(b, "\\\\", 2); break;
+		case '\n': rwire_buf_append(b, "\\n", 2);  break;
+		case '\r': rwire_buf_append(b, "\\r", 2);  break;
+		case '\t': rwire_buf_append(b, "\\t", 2);  break;
+		case '\b': rwire_buf_append(b, "\\b", 2);  break;
+		case '\f': rwire_buf_append(b, "\\f", 2);  break;
+		default: {
+			char u[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+			rwire_buf_append(b, u, 6);
+		}
+		}
+	}
+	rwire_buf_append(b, p + start, n - start);
+	rwire_buf_byte(b, '"');
+}
+
+// printf with the decimal point JSON wants, whatever the C locale says
+static int rwire_json_format_float(char * s, size_t size, int precision, double d)
+{
+	const char * point = localeconv()->decimal_point;
+	size_t len = point ? strlen(point) : 1;
+	int    n   = snprintf(s, size, "%.*g", precision, d);
+	char * p;
+
+	if (len && (len > 1 || *point != '.') && (p = strstr(s, point)) != NULL) {
+		*p = '.';
+		memmove(p + 1, p + len, strlen(p + len) + 1);
+		n -= len - 1;
+	}
+	return n;
+}
+
+// Shortest form that reads back as the same double, always with a '.' or
+// an exponent so that it reads back as a Float
+static void rwire_json_encode_float(rwire_buf_t * b, double d)
+{
+	char s[32];
+	int  precision, n;
+
+	if (isnan(d) || isinf(d))
+		rb_raise(rb_eArgError, "Can't encode %f as JSON", d);
+
+	for (precision = 15; precision < 17; precision++) {
+		rwire_json_format_float(s, sizeof(s), precision, d);
+		if (rb_cstr_to_dbl(s, 0) == d)
+			break;
+	}
+	n = rwire_json_format_float(s, sizeof(s), precision, d);
+	rwire_buf_append(b, s, n);
+	if (!strpbrk(s, ".e"))
+		rwire_buf_append(b, ".0", 2);
+}
+
+static int rwire_json_encode_pair(VALUE key, VALUE value, VALUE p)
+{
+	rwire_buf_t * b = (rwire_buf_t *)p;
+
+	if (b->ptr[b->len - 1] != '{')
+		rwire_buf_byte(b, ',');
+	if (SYMBOL_P(key))
+		key = rwire_codec_sym_str(key);
+	else if (TYPE(key) != T_STRING)
+		key = rb_obj_as_string(key);
+	key = rwire_codec_utf8(key, "JSON");
+	rwire_json_encode_str(b, RSTRING_PTR(key), RSTRING_LEN(key));
+	rwire_buf_byte(b, ':');
+	rwire_json_encode(b, value);
+	return ST_CONTINUE;
+}
+
+static void rwire_json_encode(rwire_buf_t * b, VALUE obj)
+{
+	char s[24];
+	long i, n;
+
+	switch (TYPE(obj)) {
+	case T_NIL:
+		rwire_buf_append(b, "null", 4);
+		break;
+	case T_FALSE:
+		rwire_buf_append(b, "false", 5);
+		break;
+	case T_TRUE:
+		rwire_buf_append(b, "true", 4);
+		break;
+	case T_FIXNUM:
+		n = snprintf(s, sizeof(s), "%ld", FIX2LONG(obj));
+		rwire_buf_append(b, s, n);
+		break;
+	case T_BIGNUM:
+		obj = rb_big2str(obj, 10);
+		rwire_buf_append(b, RSTRING_PTR(obj), RSTRING_LEN(obj));
+		break;
+	case T_FLOAT:
+		rwire_json_encode_float(b, RFLOAT_VALUE(obj));
+		break;
+	case T_STRING:
+		obj = rwire_codec_utf8(obj, "JSON");
+		rwire_json_encode_str(b, RSTRING_PTR(obj), RSTRING_LEN(obj));
+		break;
+	case T_SYMBOL:
+		obj = rwire_codec_utf8(rwire_codec_sym_str(obj), "JSON");
+		rwire_json_encode_str(b, RSTRING_PTR(obj), RSTRING_LEN(obj));
+		break;
+	case T_ARRAY:
+		rwire_codec_enter(b);
+		rwire_buf_byte(b, '[');
+		n = RARRAY_LEN(obj);
+		for (i = 0; i < n; i++) {
+			if (i)
+				rwire_buf_byte(b, ',');
+			rwire_json_encode(b, rb_ary_entry(obj, i));
+		}
+		rwire_buf_byte(b, ']');
+		b->depth--;
+		break;
+	case T_HASH:
+		rwire_codec_enter(b);
+		rwire_buf_byte(b, '{');
+		rb_hash_foreach(obj, rwire_json_encode_pair, (VALUE)b);
+		rwire_buf_byte(b, '}');
+		b->depth--;
+		break;
+	default:
+		rb_raise(rb_eTypeError, "Can't encode %s as JSON", rb_obj_classname(obj));
+	}
+}
+
+typedef struct {
+	rwire_buf_t * buf;
+	VALUE         obj;
+	int           format;
+} rwire_encode_t;
+
+static VALUE rwire_encode_protected(VALUE p)
+{
+	rwire_encode_t * e = (rwire_encode_t *)p;
+
+	if (e->format == RWIRE_CODEC_MSGPACK)
+		rwire_msgpack_encode(e->buf, e->obj);
+	else
+		rwire_json_encode(e->buf, e->obj);
+
+	return Qnil;
+}
+
+//
+// Decoding
+//
+
+typedef struct {
+	const unsigned char * p;
+	const unsigned char * end;
+	int                   depth;
+	bool                  symbolize;
+	char                * body;      // The copy of the body, freed after
+	rwire_buf_t           scratch;   // For JSON strings with escapes
+} rwire_decoder_t;
+
+static void rwire_decode_fail(rwire_decoder_t * d, const char * what)
+{
+	rb_raise(eAMQDecodeError, "Malformed %s body at byte %ld", what,
+		(long)(d->p - (const unsigned char *)d->body));
+}
+
+static VALUE rwire_decode_key(rwire_decoder_t * d, VALUE key)
+{
+	if (d->symbolize && TYPE(key) == T_STRING)
+		return rb_str_intern(key);
+	return key;
+}
+
+static uint64_t rwire_msgpack_take(rwire_decoder_t * d, int n)
+{
+	uint64_t v = 0;
+
+	if (d->end - d->p < n)
+		rwire_decode_fail(d, "MessagePack");
+	while (n--)
+		v = (v << 8) | *d->p++;
+	return v;
+}
+
+static VALUE rwire_msgpack_decode(rwire_decoder_t * d);
+
+static VALUE rwire_msgpack_decode_str(rwire_decoder_t * d, uint64_t n, bool binary)
+{
+	const char * p = (const char *)d->p;
+
+	if ((uint64_t)(d->end - d->p) < n)
+		rwire_decode_fail(d, "MessagePack");
+	d->p += n;
+	return binary ? rb_str_new(p, n) : rwire_utf8_str_new(p, n);
+}
+
+static VALUE rwire_msgpack_decode_array(rwire_decoder_t * d, uint64_t n)
+{
+	VALUE    ary;
+	uint64_t i;
+
+	// Every element takes at least a byte, which bounds what a corrupt
+	// length can make us allocate
+	if ((uint64_t)(d->end - d->p) < n)
+		rwire_decode_fail(d, "MessagePack");
+	if (++d->depth > RWIRE_CODEC_MAX_DEPTH)
+		rwire_decode_fail(d, "MessagePack");
+
+	ary = rb_ary_new2(n);
+	for (i = 0; i < n; i++)
+		rb_ary_push(ary, rwire_msgpack_decode(d));
+	d->depth--;
+	return ary;
+}
+
+static VALUE rwire_msgpack_decode_map(rwire_decoder_t * d, uint64_t n)
+{
+	VALUE    hash, key;
+	uint64_t i;
+
+	if ((uint64_t)(d->end - d->p) < n * 2)
+		rwire_decode_fail(d, "MessagePack");
+	if (++d->depth > RWIRE_CODEC_MAX_DEPTH)
+		rwire_decode_fail(d, "MessagePack");
+
+	hash = rb_hash_new();
+	for (i = 0; i < n; i++) {
+		key = rwire_decode_key(d, rwire_msgpack_decode(d));
+		rb_hash_aset(hash, key, rwire_msgpack_decode(d));
+	}
+	d->depth--;
+	return hash;
+}
+
+static VALUE rwire_msgpack_decode(rwire_decoder_t * d)
+{
+	union { double d; uint64_t u; } f64;
+	union { float f; uint32_t u; } f32;
+	int c;
+
+	if (d->p >= d->end)
+		rwire_decode_fail(d, "MessagePack");
+	c = *d->p++;
+
+	if (c < 0x80)
+		return INT2FIX(c);
+	if (c >= 0xe0)
+		return INT2FIX(c - 0x100);
+	if ((c & 0xe0) == 0xa0)
+		return rwire_msgpack_decode_str(d, c & 0x1f, false);
+	if ((c & 0xf0) == 0x90)
+		return rwire_msgpack_decode_array(d, c & 0x0f);
+	if ((c & 0xf0) == 0x80)
+		return rwire_msgpack_decode_map(d, c & 0x0f);
+
+	switch (c) {
+	case 0xc0: return Qnil;
+	case 0xc2: return Qfalse;
+	case 0xc3: return Qtrue;
+	case 0xc4: return rwire_msgpack_decode_str(d, rwire_msgpack_take(d, 1), true);
+	case 0xc5: return rwire_msgpack_decode_str(d, rwire_msgpack_take(d, 2), true);
+	case 0xc6: return rwire_msgpack_decode_str(d, rwire_msgpack_take(d, 4), true);
+	case 0xca:
+		f32.u = (uint32_t)rwire_msgpack_take(d, 4);
+		return rb_float_new(f32.f);
+	case 0xcb:
+		f64.u = rwire_msgpack_take(d, 8);
+		return rb_float_new(f64.d);
+	case 0xcc: return INT2FIX(rwire_msgpack_take(d, 1));
+	case 0xcd: return INT2FIX(rwire_msgpack_take(d, 2));
+	case 0xce: return ULL2NUM(rwire_msgpack_take(d, 4));
+	case 0xcf: return ULL2NUM(rwire_msgpack_take(d, 8));
+	case 0xd0: return INT2FIX((int8_t)rwire_msgpack_take(d, 1));
+	case 0xd1: return INT2FIX((int16_t)rwire_msgpack_take(d, 2));
+	case 0xd2: return LL2NUM((int32_t)rwire_msgpack_take(d, 4));
+	case 0xd3: return LL2NUM((int64_t)rwire_msgpack_take(d, 8));
+	case 0xd9: return rwire_msgpack_decode_str(d, rwire_msgpack_take(d, 1), false);
+	case 0xda: return rwire_msgpack_decode_str(d, rwire_msgpack_take(d, 2), false);
+	case 0xdb: return rwire_msgpack_decode_str(d, rwire_msgpack_take(d, 4), false);
+	case 0xdc: return rwire_msgpack_decode_array(d, rwire_msgpack_take(d, 2));
+	case 0xdd: return rwire_msgpack_decode_array(d, rwire_msgpack_take(d, 4));
+	case 0xde: return rwire_msgpack_decode_map(d, rwire_msgpack_take(d, 2));
+	case 0xdf: return rwire_msgpack_decode_map(d, rwire_msgpack_take(d, 4));
+	default:
+		// 0xc1 is never used, the rest are extension types
+		rb_raise(eAMQDecodeError, "Unsupported MessagePack type 0x%02x", c);
+	}
+	return Qnil;
+}
+
+static VALUE rwire_json_decode(rwire_decoder_t * d);
+
+static void rwire_json_skip_space(rwire_decoder_t * d)
+{
+	while (d->p < d->end && (*d->p == ' ' || *d->p == '\t' || *d->p == '\n' || *d->p == '\r'))
+		d->p++;
+}
+
+static void rwire_json_expect(rwire_decoder_t * d, const char * word)
+{
+	size_t n = strlen(word);
+
+	if ((size_t)(d->end - d->p) < n || memcmp(d->p, word, n))
+		rwire_decode_fail(d, "JSON");
+	d->p += n;
+}
+
+static int rwire_json_hex4(rwire_decoder_t * d)
+{
+	int i, c, v = 0;
+
+	if (d->end - d->p < 4)
+		rwire_decode_fail(d, "JSON");
+	for (i = 0; i < 4; i++) {
+		c = *d->p++;
+		v <<= 4;
+		if (c >= '0' && c <= '9')      v |= c - '0';
+		else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+		else rwire_decode_fail(d, "JSON");
+	}
+	return v;
+}
+
+static void rwire_buf_utf8(rwire_buf_t * b, unsigned long cp)
+{
+	char u[4];
+	int  n;
+
+	if (cp < 0x80) {
+		u[0] = (char)cp; n = 1;
+	}
+	else if (cp < 0x800) {
+		u[0] = (char)(0xc0 | (cp >> 6));
+		u[1] = (char)(0x80 | (cp & 0x3f)); n = 2;
+	}
+	else if (cp < 0x10000) {
+		u[0] = (char)(0xe0 | (cp >> 12));
+		u[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+		u[2] = (char)(0x80 | (cp & 0x3f)); n = 3;
+	}
+	else {
+		u[0] = (char)(0xf0 | (cp >> 18));
+		u[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+		u[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+		u[3] = (char)(0x80 | (cp & 0x3f)); n = 4;
+	}
+	rwire_buf_append(b, u, n);
+}
+
+static VALUE rwire_json_decode_str(rwire_decoder_t * d)
+{
+	const unsigned char * start = ++d->p;   // Past the opening quote
+	rwire_buf_t * b = &d->scratch;
+	unsigned long cp, lo;
+	int c;
+
+	// Without escapes the string is a slice of the body
+	while (d->p < d->end && *d->p != '"' && *d->p != '\\' && *d->p >= 0x20)
+		d->p++;
+	if (d->p < d->end && *d->p == '"')
+		return rwire_utf8_str_new((const char *)start, d->p++ - start);
+
+	b->len = 0;
+	rwire_buf_append(b, start, d->p - start);
+	for (;;) {
+		if (d->p >= d->end)
+			rwire_decode_fail(d, "JSON");
+		c = *d->p++;
+		if (c == '"')
+			break;
+		if (c < 0x20)
+			rwire_decode_fail(d, "JSON");
+		if (c != '\\') {
+			rwire_buf_byte(b, c);
+			continue;
+		}
+
+		if (d->p >= d->end)
+			rwire_decode_fail(d, "JSON");
+		switch (c = *d->p++) {
+		case '"': case '\\': case '/': rwire_buf_byte(b, c); break;
+		case 'n': rwire_buf_byte(b, '\n'); break;
+		case 'r': rwire_buf_byte(b, '\r'); break;
+		case 't': rwire_buf_byte(b, '\t'); break;
+		case 'b': rwire_buf_byte(b, '\b'); break;
+		case 'f': rwire_buf_byte(b, '\f'); break;
+		case 'u':
+			cp = rwire_json_hex4(d);
+			if (cp >= 0xd800 && cp < 0xdc00) {
+				// A surrogate pair makes up one code point
+				rwire_json_expect(d, "\\u");
+				lo = rwire_json_hex4(d);
+				if (lo < 0xdc00 || lo >= 0xe000)
+					rwire_decode_fail(d, "JSON");
+				cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+			}
+			else if (cp >= 0xdc00 && cp < 0xe000)
+				rwire_decode_fail(d, "JSON");
+			rwire_buf_utf8(b, cp);
+			break;
+		default:
+			rwire_decode_fail(d, "JSON");
+		}
+	}
+	return rwire_utf8_str_new(b->ptr, b->len);
+}
+
+static VALUE rwire_json_decode_number(rwire_decoder_t * d)
+{
+	const unsigned char * start = d->p;
+	bool     integer = true;
+	uint64_t v = 0;
+	int      digits = 0;
+
+	if (*d->p == '-')
+		d->p++;
+	if (d->p >= d->end || !isdigit(*d->p))
+		rwire_decode_fail(d, "JSON");
+	if (*d->p == '0' && d->p + 1 < d->end && isdigit(d->p[1]))
+		rwire_decode_fail(d, "JSON");
+	while (d->p < d->end && isdigit(*d->p)) {
+		v = v * 10 + (*d->p++ - '0');
+		digits++;
+	}
+	if (d->p < d->end && *d->p == '.') {
+		integer = false;
+		d->p++;
+		if (d->p >= d->end || !isdigit(*d->p))
+			rwire_decode_fail(d, "JSON");
+		while (d->p < d->end && isdigit(*d->p))
+			d->p++;
+	}
+	if (d->p < d->end && (*d->p == 'e' || *d->p == 'E')) {
+		integer = false;
+		d->p++;
+		if (d->p < d->end && (*d->p == '+' || *d->p == '-'))
+			d->p++;
+		if (d->p >= d->end || !isdigit(*d->p))
+			rwire_decode_fail(d, "JSON");
+		while (d->p < d->end && isdigit(*d->p))
+			d->p++;
+	}
+
+	// The body copy is NUL terminated, so the conversions stop at the end of
+	// the number at the latest.  rb_cstr_to_dbl, unlike strtod, ignores the C
+	// locale's decimal point.
+	if (!integer)
+		return rb_float_new(rb_cstr_to_dbl((const char *)start, 0));
+	if (digits <= 18)
+		return LL2NUM(*start == '-' ? -(int64_t)v : (int64_t)v);
+	return rb_cstr2inum((const char *)start, 10);
+}
+
+static VALUE rwire_json_decode_array(rwire_decoder_t * d)
+{
+	VALUE ary = rb_ary_new();
+
+	d->p++;
+	rwire_json_skip_space(d);
+	if (d->p < d->end && *d->p == ']') {
+		d->p++;
+		return ary;
+	}
+	for (;;) {
+		rb_ary_push(ary, rwire_json_decode(d));
+		rwire_json_skip_space(d);
+		if (d->p >= d->end)
+			rwire_decode_fail(d, "JSON");
+		if (*d->p == ']')
+			break;
+		if (*d->p++ != ',')
+			rwire_decode_fail(d, "JSON");
+	}
+	d->p++;
+	return ary;
+}
+
+static VALUE rwire_json_decode_object(rwire_decoder_t * d)
+{
+	VALUE hash = rb_hash_new();
+	VALUE key;
+
+	d->p++;
+	rwire_json_skip_space(d);
+	if (d->p < d->end && *d->p == '}') {
+		d->p++;
+		return hash;
+	}
+	for (;;) {
+		rwire_json_skip_space(d);
+		if (d->p >= d->end || *d->p != '"')
+			rwire_decode_fail(d, "JSON");
+		key = rwire_decode_key(d, rwire_json_decode_str(d));
+		rwire_json_skip_space(d);
+		rwire_json_expect(d, ":");
+		rb_hash_aset(hash, key, rwire_json_decode(d));
+		rwire_json_skip_space(d);
+		if (d->p >= d->end)
+			rwire_decode_fail(d, "JSON");
+		if (*d->p == '}')
+			break;
+		if (*d->p++ != ',')
+			rwire_decode_fail(d, "JSON");
+	}
+	d->p++;
+	return hash;
+}
+
+static VALUE rwire_json_decode(rwire_decoder_t * d)
+{
+	VALUE result;
+
+	rwire_json_skip_space(d);
+	if (d->p >= d->end)
+		rwire_decode_fail(d, "JSON");
+
+	switch (*d->p) {
+	case '{':
+	case '[':
+		if (++d->depth > RWIRE_CODEC_MAX_DEPTH)
+			rwire_decode_fail(d, "JSON");
+		result = *d->p == '{' ? rwire_json_decode_object(d) : rwire_json_decode_array(d);
+		d->depth--;
+		return result;
+	case '"':
+		return rwire_json_decode_str(d);
+	case 't':
+		rwire_json_expect(d, "true");
+		return Qtrue;
+	case 'f':
+		rwire_json_expect(d, "false");
+		return Qfalse;
+	case 'n':
+		rwire_json_expect(d, "null");
+		return Qnil;
+	default:
+		return rwire_json_decode_number(d);
+	}
+}
+
+typedef struct {
+	rwire_decoder_t * decoder;
+	int               format;
+} rwire_decode_t;
+
+static VALUE rwire_decode_body(VALUE p)
+{
+	rwire_decode_t  * dc = (rwire_decode_t *)p;
+	rwire_decoder_t * d  = dc->decoder;
+	VALUE result;
+
+	if (dc->format == RWIRE_CODEC_MSGPACK) {
+		result = rwire_msgpack_decode(d);
+		if (d->p != d->end)
+			rwire_decode_fail(d, "MessagePack");
+	}
+	else {
+		result = rwire_json_decode(d);
+		rwire_json_skip_space(d);
+		if (d->p != d->end)
+			rwire_decode_fail(d, "JSON");
+	}
+	return result;
+}
+
+static VALUE rwire_decode_cleanup(VALUE p)
+{
+	rwire_decoder_t * d = ((rwire_decode_t *)p)->decoder;
+
+	free(d->body);
+	free(d->scratch.ptr);
+	return Qnil;
+}
+
+// The codec for a format Symbol, or for a content type when format is nil
+static int rwire_codec_find(VALUE format, const char * content_type)
+{
+	if (!NIL_P(format)) {
+		if (format == ID2SYM(rb_intern("msgpack")))
+			return RWIRE_CODEC_MSGPACK;
+		if (format == ID2SYM(rb_intern("json")))
+			return RWIRE_CODEC_JSON;
+		rb_raise(rb_eArgError, "Unknown body format; use :msgpack or :json");
+	}
+
+	if (content_type) {
+		// Ignore parameters such as "; charset=utf-8"
+		size_t n = strcspn(content_type, "; ");
+		if ((n == strlen(RWIRE_MSGPACK_TYPE) && !strncmp(content_type, RWIRE_MSGPACK_TYPE, n)) ||
+			(n == strlen("application/msgpack") && !strncmp(content_type, "application/msgpack", n)))
+			return RWIRE_CODEC_MSGPACK;
+		if (n == strlen(RWIRE_JSON_TYPE) && !strncmp(content_type, RWIRE_JSON_TYPE, n))
+			return RWIRE_CODEC_JSON;
+	}
+	return -1;
+}
+
+// encode_body(object, format) where format is :msgpack or :json.  Sets the
+// body and the content type.
+static VALUE rwire_amq_content_basic_encode_body(VALUE self, VALUE object, VALUE format)
+{
+	amq_content_basic_t * content = NULL;
+	rwire_buf_t    buf;
+	rwire_encode_t e;
+	int state = 0;
+
+	Data_Get_Struct(self, amq_content_basic_t, content);
+	if (!content)
+		rb_raise(eAMQDestroyedError, "Content has already been unlinked");
+
+	memset(&buf, 0, sizeof(buf));
+	e.buf    = &buf;
+	e.obj    = object;
+	e.format = rwire_codec_find(format, NULL);
+
+	rb_protect(rwire_encode_protected, (VALUE)&e, &state);
+	if (state) {
+		free(buf.ptr);
+		rb_jump_tag(state);
+	}
+
+	// The content takes over the buffer
+	if (amq_content_basic_set_body(content, buf.ptr, buf.len, free)) {
+		free(buf.ptr);
+		rb_raise(eAMQError, "Failed to set content body");
+	}
+	amq_content_basic_set_content_type(content,
+		e.format == RWIRE_CODEC_MSGPACK ? RWIRE_MSGPACK_TYPE : RWIRE_JSON_TYPE);
+
+	return self;
+}
+
+// decode_body(format = nil, symbolize_keys = false).  The format comes from
+// the content type unless given, and must agree with it if both are set.
+// Raises AMQDecodeError if the body isn't valid.
+static VALUE rwire_amq_content_basic_decode_body(int argc, VALUE *argv, VALUE self)
+{
+	amq_content_basic_t * content = NULL;
+	rwire_decoder_t d;
+	rwire_decode_t  dc;
+	VALUE  format, symbolize, result;
+	char * content_type;
+	int    found, given;
+	size_t size;
+
+	rb_scan_args(argc, argv, "02", &format, &symbolize);
+
+	Data_Get_Struct(self, amq_content_basic_t, content);
+	if (!content)
+		rb_raise(eAMQDestroyedError, "Content has already been unlinked");
+
+	content_type = amq_content_basic_get_content_type(content);
+	found = rwire_codec_find(Qnil, content_type);
+	given = NIL_P(format) ? found : rwire_codec_find(format, NULL);
+	if (given < 0)
+		rb_raise(eAMQDecodeError, "Can't decode a body of content type '%s'",
+			content_type ? content_type : "");
+	if (content_type && *content_type && found != given)
+		rb_raise(eAMQDecodeError, "Content type '%s' doesn't match the format",
+			content_type);
+
+	size = amq_content_basic_get_body_size(content);
+
+	memset(&d, 0, sizeof(d));
+	d.symbolize = TO_BOOL(symbolize);
+	d.body = malloc(size + 1);
+	if (!d.body)
+		rb_raise(rb_eNoMemError, "Failed to allocate %ld bytes", (long)size);
+	rwire_copy_body(content, d.body, size);
+	d.body[size] = '\0';
+	d.p   = (const unsigned char *)d.body;
+	d.end = d.p + size;
+
+	dc.decoder = &d;
+	dc.format  = given;
+	result = rb_ensure(rwire_decode_body, (VALUE)&dc, rwire_decode_cleanup, (VALUE)&dc);
+	RWIRE_HOOKS_FLUSH();
+	return result;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// Functions for RWire::Connection
+//
+/////////////////////////////////////////////////////////////////////////////
+static VALUE rwire_connection_destroy(VALUE self)
+{
+	CONNECTION_GET;
+	if (c) {
+		rwire_disown(c);
+		amq_client_connection_destroy((amq_client_connection_t**)&(DATA_PTR(self)));
+	}
+	return self;
+}
+
+static VALUE rwire_amq_client_connection_get_alive(VALUE self)
+{
+	CONNECTION_GET;
+	if (c) {
+		return amq_client_connection_get_alive(c) ? Qtrue : Qfalse;
+	}
+	return Qfalse;
+}
+
+static VALUE rwire_amq_client_connection_get_silent(VALUE self)
+{
+	CONNECTION_GET;
+	if (!c) {
+		rb_raise(eAMQDestroyedError, "Connection has aleady been destroyed");
+	}
+	return amq_client_connection_get_silent(c) ? Qtrue : Qfalse;
+}
+
+static VALUE rwire_amq_client_connection_set_silent(VALUE self, VALUE silent)
+{
+	CONNECTION_GET;
+	if (!c) {
+		rb_raise(eAMQDestroyedError, "Connection has aleady been destroyed");
+	}
+	return amq_client_connection_set_silent(c, silent);
+}
+
+DEF_CLIENT_CONNECTION_INT_GETTER(channel_max, UINT2NUM)
+DEF_CLIENT_CONNECTION_INT_GETTER(class_id, INT2FIX)
+DEF_STRING_GETTER(error_text, amq_client_connection)
+DEF_CLIENT_CONNECTION_INT_GETTER(frame_max, ULONG2NUM)
+DEF_CLIENT_CONNECTION_INT_GETTER(heartbeat, INT2FIX)
+DEF_STRING_GETTER(known_hosts, amq_client_connection)
+DEF_CLIENT_CONNECTION_INT_GETTER(method_id, INT2FIX)
+DEF_CLIENT_CONNECTION_INT_GETTER(reply_code, INT2FIX)
+DEF_STRING_GETTER(reply_text, amq_client_connection)
+DEF_CLIENT_CONNECTION_INT_GETTER(version_major, CHR2FIX)
+DEF_CLIENT_CONNECTION_INT_GETTER(version_minor, CHR2FIX)
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// Functions for RWire::Deadline
+//
+/////////////////////////////////////////////////////////////////////////////
+
+// An absolute point on the monotonic clock.  Waits given a deadline work out
+// the time left from it every time round, so retries and early wake-ups
+// never stretch the total wait.
+
+typedef struct {
+	int64_t at;
+} rwire_deadline_t;
+
+static void rwire_deadline_free(void *p)
+{
+	free(p);
+}
+
+static VALUE rwire_deadline_alloc(VALUE klass)
+{
+	rwire_deadline_t * dl = calloc(1, sizeof(rwire_deadline_t));
+	return Data_Wrap_Struct(klass, 0, rwire_deadline_free, dl);
+}
+
+// initialize(msecs): the deadline is msecs from now
+static VALUE rwire_deadline_init(VALUE self, VALUE msecs)
+{
+	rwire_deadline_t * dl = NULL;
+
+	Data_Get_Struct(self, rwire_deadline_t, dl);
+	dl->at = rwire_monotonic_ns() + (int64_t)(NUM2DBL(msecs) * 1e6);
+
+	return self;
+}
+
+// Turn a timeout given from Ruby into an absolute monotonic time.  Takes
+// msecs (Integer or Float), an RWire::Deadline, or nil for no timeout.
+// Returns false when there is no timeout.
+static bool rwire_deadline_get(VALUE timeout, int64_t *at)
+{
+	rwire_deadline_t * dl = NULL;
+
+	if (NIL_P(timeout))
+		return false;
+
+	if (rb_obj_is_kind_of(timeout, cDeadline)) {
+		Data_Get_Struct(timeout, rwire_deadline_t, dl);
+		*at = dl->at;
+	}
+	else if (FIXNUM_P(timeout) || TYPE(timeout) == T_BIGNUM || TYPE(timeout) == T_FLOAT) {
+		*at = rwire_monotonic_ns() + (int64_t)(NUM2DBL(timeout) * 1e6);
+	}
+	else {
+		rb_raise(rb_eTypeError, "Timeout was not a number of msecs or an RWire::Deadline");
+	}
+	return true;
+}
+
+// Like rwire_deadline_get, for the waits where a timeout of 0 (Integer or
+// Float) waits for as long as it takes, as amq_client_session_wait does.
+static bool rwire_timeout_get(VALUE timeout, int64_t *at)
+{
+	if ((FIXNUM_P(timeout) || TYPE(timeout) == T_FLOAT) && NUM2DBL(timeout) == 0)
+		return false;
+	return rwire_deadline_get(timeout, at);
+}
+
+// Whole msecs left until at, rounded up, or 0 once it has passed
+static long rwire_deadline_left(int64_t at)
+{
+	int64_t left = at - rwire_monotonic_ns();
+	return left > 0 ? (long)((left + 999999) / 1000000) : 0;
+}
+
+// Msecs left, 0 once expired
+static VALUE rwire_deadline_get_remaining(VALUE self)
+{
+	rwire_deadline_t * dl = NULL;
+	Data_Get_Struct(self, rwire_deadline_t, dl);
+	return LONG2NUM(rwire_deadline_left(dl->at));
+}
+
+static VALUE rwire_deadline_get_expired(VALUE self)
+{
+	rwire_deadline_t * dl = NULL;
+	Data_Get_Struct(self, rwire_deadline_t, dl);
+	return rwire_monotonic_ns() >= dl->at ? Qtrue : Qfalse;
+}
+
+// The deadline on the RWire.monotonic_time clock
+static VALUE rwire_deadline_get_at(VALUE self)
+{
+	rwire_deadline_t * dl = NULL;
+	Data_Get_Struct(self, rwire_deadline_t, dl);
+	return rb_float_new(dl->at / 1e9);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// Functions for RWire::Capture and RWire::CaptureReader
+//
+/////////////////////////////////////////////////////////////////////////////
+
+// A capture file holds a header followed by one record per message.  Records
+// are only ever appended.  Everything is in host byte order and 8 byte
+// aligned, so a reader can map the file and walk the records in place.  Each
+// record is followed by its string fields and then the body.
+
+#define RWIRE_CAPTURE_MAGIC "RWCAP001"
+
+enum {
+	RWIRE_CAPTURE_PUBLISHED = 1,
+	RWIRE_CAPTURE_CONSUMED  = 2
+};
+
+enum {
+	RWIRE_CAPTURE_EXCHANGE,
+	RWIRE_CAPTURE_ROUTING_KEY,
+	RWIRE_CAPTURE_MESSAGE_ID,
+	RWIRE_CAPTURE_CONTENT_TYPE,
+	RWIRE_CAPTURE_CORRELATION_ID,
+	RWIRE_CAPTURE_REPLY_TO,
+	RWIRE_CAPTURE_FIELDS
+};
+
+static const char * rwire_capture_field_names[RWIRE_CAPTURE_FIELDS] = {
+	"exchange", "routing_key", "message_id", "content_type", "correlation_id", "reply_to"
+};
+
+typedef struct {
+	char     magic[8];
+	int64_t  started_at;    // Wall clock, nsecs since the epoch
+	int64_t  reserved[2];
+} rwire_capture_header_t;
+
+typedef struct {
+	uint32_t length;        // Whole record, padding included
+	uint8_t  kind;
+	uint8_t  delivery_mode;
+	uint8_t  priority;
+	uint8_t  reserved;
+	int64_t  offset;        // Nsecs since the capture started
+	uint16_t field_len[RWIRE_CAPTURE_FIELDS];
+	uint32_t body_len;
+} rwire_capture_record_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	FILE           *file;
+	int64_t         started;
+	long            count;
+	int64_t         bytes;
+	int             error;      // errno of the write that failed, or 0
+} rwire_capture_t;
+
+static ID id_capture;
+
+static void rwire_capture_close_file(rwire_capture_t *cap)
+{
+	if (cap->file) {
+		if (fclose(cap->file) != 0 && !cap->error)
+			cap->error = errno ? errno : EIO;
+		cap->file = NULL;
+	}
+}
+
+// Writes out len bytes, or stops the capture: after a short write the rest of
+// the file can't be parsed, so nothing more goes in.  Call with the lock held.
+static bool rwire_capture_put(rwire_capture_t *cap, const void *data, size_t len)
+{
+	if (!cap->file)
+		return false;
+	if (len == 0 || fwrite(data, 1, len, cap->file) == len)
+		return true;
+
+	cap->error = errno ? errno : EIO;
+	rwire_capture_close_file(cap);
+	return false;
+}
+
+// Raise the error that stopped the capture, if any
+static void rwire_capture_check(rwire_capture_t *cap)
+{
+	if (cap->error) {
+		errno = cap->error;
+		rb_sys_fail("Capture write failed");
+	}
+}
+
+static void rwire_capture_free(void *p)
+{
+	rwire_capture_t * cap = (rwire_capture_t *)p;
+
+	rwire_capture_close_file(cap);
+	pthread_mutex_destroy(&cap->lock);
+	free(cap);
+}
+
+static VALUE rwire_capture_alloc(VALUE klass)
+{
+	rwire_capture_t * cap = calloc(1, sizeof(rwire_capture_t));
+	pthread_mutex_init(&cap->lock, NULL);
+	return Data_Wrap_Struct(klass, 0, rwire_capture_free, cap);
+}
+
+// Create (or truncate) the capture file at path
+static VALUE rwire_capture_init(VALUE self, VALUE path)
+{
+	rwire_capture_t      * cap = NULL;
+	rwire_capture_header_t header;
+	struct timeval         now;
+
+	Data_Get_Struct(self, rwire_capture_t, cap);
+	if (cap->file)
+		rb_raise(eAMQError, "Capture is already open");
+
+	cap->file = fopen(StringValuePtr(path), "wb");
+	if (!cap->file)
+		rb_sys_fail(StringValuePtr(path));
+
+	gettimeofday(&now, NULL);
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RWIRE_CAPTURE_MAGIC, sizeof(header.magic));
+	header.started_at = (int64_t)now.tv_sec * 1000000000 + (int64_t)now.tv_usec * 1000;
+
+	if (fwrite(&header, sizeof(header), 1, cap->file) != 1) {
+		rwire_capture_close_file(cap);
+		rb_sys_fail(StringValuePtr(path));
+	}
+	cap->started = rwire_monotonic_ns();
+
+	return self;
+}
+
+static void rwire_capture_write(rwire_capture_t *cap, int kind,
+	amq_content_basic_t *content, char *exchange, char *routing_key,
+	char *body, size_t body_len)
+{
+	static const char padding[8] = { 0 };
+	rwire_capture_record_t rec;
+	char  * fields[RWIRE_CAPTURE_FIELDS];
+	size_t  len = sizeof(rec);
+	int     i;
+
+	fields[RWIRE_CAPTURE_EXCHANGE]       = exchange;
+	fields[RWIRE_CAPTURE_ROUTING_KEY]    = routing_key;
+	fields[RWIRE_CAPTURE_MESSAGE_ID]     = amq_content_basic_get_message_id(content);
+	fields[RWIRE_CAPTURE_CONTENT_TYPE]   = amq_content_basic_get_content_type(content);
+	fields[RWIRE_CAPTURE_CORRELATION_ID] = amq_content_basic_get_correlation_id(content);
+	fields[RWIRE_CAPTURE_REPLY_TO]       = amq_content_basic_get_reply_to(content);
+
+	memset(&rec, 0, sizeof(rec));
+	for (i = 0; i < RWIRE_CAPTURE_FIELDS; i++) {
+		size_t n = fields[i] ? strlen(fields[i]) : 0;
+		rec.field_len[i] = n > 0xFFFF ? 0xFFFF : n;
+		len += rec.field_len[i];
+	}
+	len += body_len;
+
+	rec.length        = (len + 7) & ~7;
+	rec.kind          = kind;
+	rec.delivery_mode = amq_content_basic_get_delivery_mode(content);
+	rec.priority      = amq_content_basic_get_priority(content);
+	rec.body_len      = body_len;
+
+	pthread_mutex_lock(&cap->lock);
+	if (cap->file) {
+		bool ok;
+
+		rec.offset = rwire_monotonic_ns() - cap->started;
+		ok = rwire_capture_put(cap, &rec, sizeof(rec));
+		for (i = 0; ok && i < RWIRE_CAPTURE_FIELDS; i++)
+			ok = rwire_capture_put(cap, fields[i], rec.field_len[i]);
+		ok = ok && rwire_capture_put(cap, body, body_len) &&
+			rwire_capture_put(cap, padding, rec.length - len);
+		if (ok) {
+			cap->count++;
+			cap->bytes += rec.length;
+		}
+	}
+	pthread_mutex_unlock(&cap->lock);
+}
+
+// Capture a content whose body has to be copied out first
+static void rwire_capture_content(rwire_capture_t *cap, int kind,
+	amq_content_basic_t *content, char *exchange, char *routing_key)
+{
+	int64_t size = amq_content_basic_get_body_size(content);
+	char  * body = malloc(size ? size : 1);
+
+	rwire_copy_body(content, body, size);
+	rwire_capture_write(cap, kind, content, exchange, routing_key, body, size);
+	free(body);
+}
+
+// The capture attached to a session, or NULL
+static rwire_capture_t * rwire_session_capture(VALUE r_session)
+{
+	rwire_capture_t * cap = NULL;
+	VALUE rb_cap = rb_ivar_get(r_session, id_capture);
+
+	if (!NIL_P(rb_cap)) {
+		Data_Get_Struct(rb_cap, rwire_capture_t, cap);
+	}
+	return cap;
+}
+
+// Contents handed back to a session by a helper that took them off it but
+// never yielded them (Conflator#release and the like) wait in an
+// RWire::LocalQueue in @held.  The session serves them again ahead of
+// anything new, as if they had never left its arrived queue.
+static ID id_held;
+
+static VALUE rwire_local_queue_alloc(VALUE klass);
+static void rwire_local_queue_give(VALUE self, amq_content_basic_t *content);
+static amq_content_basic_t * rwire_local_queue_take(VALUE self);
+static long rwire_local_queue_count(VALUE self);
+
+// Give a content back to a session, taking over the caller's link
+static void rwire_session_hand_back(VALUE r_session, amq_content_basic_t *content)
+{
+	VALUE held = rb_ivar_get(r_session, id_held);
+
+	if (NIL_P(held)) {
+		held = rwire_local_queue_alloc(cLocalQueue);
+		rb_ivar_set(r_session, id_held, held);
+	}
+	rwire_local_queue_give(held, content);
+}
+
+static long rwire_session_held_count(VALUE r_session)
+{
+	VALUE held = rb_ivar_get(r_session, id_held);
+	return NIL_P(held) ? 0 : rwire_local_queue_count(held);
+}
+
+// The next content for a consumer of the session: a handed back one first,
+// or else the next to arrive, captured on the way in.  Sets *again for a
+// handed back content, which has been through the helpers once already.
+static amq_content_basic_t * rwire_session_arrived(VALUE r_session,
+	amq_client_session_t *session, rwire_capture_t *cap, bool *again)
+{
+	VALUE held = rb_ivar_get(r_session, id_held);
+	amq_content_basic_t * content = NULL;
+
+	if (!NIL_P(held) && (content = rwire_local_queue_take(held)) != NULL) {
+		if (again)
+			*again = true;
+		return content;
+	}
+	if (again)
+		*again = false;
+
+	content = rwire_basic_arrived(session);
+	if (content && cap) {
+		rwire_capture_content(cap, RWIRE_CAPTURE_CONSUMED, content,
+			amq_content_basic_get_exchange(content),
+			amq_content_basic_get_routing_key(content));
+	}
+	return content;
+}
+
+// record(kind, content, exchange, routing_key), for messages that don't go
+// through a session, with kind :published or :consumed
+static VALUE rwire_capture_record(VALUE self, VALUE kind, VALUE r_content,
+	VALUE exchange, VALUE routing_key)
+{
+	rwire_capture_t     * cap     = NULL;
+	amq_content_basic_t * content = NULL;
+
+	Data_Get_Struct(self, rwire_capture_t, cap);
+	Data_Get_Struct(r_content, amq_content_basic_t, content);
+	if (!content)
+		rb_raise(eAMQDestroyedError, "Content has already been unlinked");
+
+	rwire_capture_content(cap,
+		SYM2ID(kind) == rb_intern("consumed") ? RWIRE_CAPTURE_CONSUMED : RWIRE_CAPTURE_PUBLISHED,
+		content,
+		NIL_P(exchange) ? NULL : StringValuePtr(exchange),
+		NIL_P(routing_key) ? NULL : StringValuePtr(routing_key));
+	RWIRE_HOOKS_FLUSH();
+	rwire_capture_check(cap);
+
+	return self;
+}
+
+static VALUE rwire_capture_flush(VALUE self)
+{
+	rwire_capture_t * cap = NULL;
+
+	Data_Get_Struct(self, rwire_capture_t, cap);
+	pthread_mutex_lock(&cap->lock);
+	if (cap->file && fflush(cap->file) != 0) {
+		cap->error = errno ? errno : EIO;
+		rwire_capture_close_file(cap);
+	}
+	pthread_mutex_unlock(&cap->lock);
+	rwire_capture_check(cap);
+
+	return self;
+}
+
+// Close the file.  Raises if a write failed since the capture started.
+static VALUE rwire_capture_close(VALUE self)
+{
+	rwire_capture_t * cap = NULL;
+	int error;
+
+	Data_Get_Struct(self, rwire_capture_t, cap);
+	pthread_mutex_lock(&cap->lock);
+	rwire_capture_close_file(cap);
+	pthread_mutex_unlock(&cap->lock);
+	error = cap->error;
+	cap->error = 0;
+	if (error) {
+		errno = error;
+		rb_sys_fail("Capture write failed");
+	}
+
+	return self;
+}
+
+static VALUE rwire_capture_get_count(VALUE self)
+{
+	rwire_capture_t * cap = NULL;
+	Data_Get_Struct(self, rwire_capture_t, cap);
+	return LONG2NUM(cap->count);
+}
+
+static VALUE rwire_capture_get_bytes(VALUE self)
+{
+	rwire_capture_t * cap = NULL;
+	Data_Get_Struct(self, rwire_capture_t, cap);
+	return LL2NUM(cap->bytes);
+}
+
+typedef struct {
+	char   *data;
+	size_t  size;
+} rwire_capture_reader_t;
+
+static void rwire_capture_reader_unmap(rwire_capture_reader_t *reader)
+{
+	if (reader->data) {
+		munmap(reader->data, reader->size);
+		reader->data = NULL;
+		reader->size = 0;
+	}
+}
+
+static void rwire_capture_reader_free(void *p)
+{
+	rwire_capture_reader_t * reader = (rwire_capture_reader_t *)p;
+	rwire_capture_reader_unmap(reader);
+	free(reader);
+}
+
+static VALUE rwire_capture_reader_alloc(VALUE klass)
+{
+	rwire_capture_reader_t * reader = calloc(1, sizeof(rwire_capture_reader_t));
+	return Data_Wrap_Struct(klass, 0, rwire_capture_reader_free, reader);
+}
+
+static VALUE rwire_capture_reader_init(VALUE self, VALUE path)
+{
+	rwire_capture_reader_t * reader = NULL;
+	struct stat st;
+	char * _path = StringValuePtr(path);
+	int fd;
+
+	Data_Get_Struct(self, rwire_capture_reader_t, reader);
+
+	fd = open(_path, O_RDONLY);
+	if (fd < 0)
+		rb_sys_fail(_path);
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		rb_sys_fail(_path);
+	}
+	if (st.st_size < (off_t)sizeof(rwire_capture_header_t)) {
+		close(fd);
+		rb_raise(eAMQError, "%s is not a capture file", _path);
+	}
+
+	reader->size = st.st_size;
+	reader->data = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (reader->data == MAP_FAILED) {
+		reader->data = NULL;
+		rb_sys_fail(_path);
+	}
+
+	if (memcmp(reader->data, RWIRE_CAPTURE_MAGIC, 8) != 0) {
+		rwire_capture_reader_unmap(reader);
+		rb_raise(eAMQError, "%s is not a capture file", _path);
+	}
+
+	return self;
+}
+
+#define CAPTURE_READER_GET \
+	rwire_capture_reader_t * reader = NULL;\
+	Data_Get_Struct(self, rwire_capture_reader_t, reader);\
+	if (!reader->data)\
+		rb_raise(eAMQError, "Capture file is closed")
+
+// The record at pos, or NULL at the end of the file.  Records cut short by a
+// crashed writer end the file as well.
+static rwire_capture_record_t * rwire_capture_reader_record(rwire_capture_reader_t *reader, size_t pos)
+{
+	rwire_capture_record_t * rec = NULL;
+	size_t len = sizeof(rwire_capture_record_t);
+	int i;
+
+	if (pos + len > reader->size)
+		return NULL;
+
+	rec = (rwire_capture_record_t *)(reader->data + pos);
+	for (i = 0; i < RWIRE_CAPTURE_FIELDS; i++)
+		len += rec->field_len[i];
+	len += rec->body_len;
+
+	if (rec->length < len || pos + rec->length > reader->size)
+		return NULL;
+
+	return rec;
+}
+
+// Yield every record as a Hash
+static VALUE rwire_capture_reader_each(VALUE self)
+{
+	rwire_capture_record_t * rec = NULL;
+	size_t pos = sizeof(rwire_capture_header_t);
+	char * data;
+	VALUE  hash;
+	int    i;
+
+	CAPTURE_READER_GET;
+
+	while ((rec = rwire_capture_reader_record(reader, pos)) != NULL) {
+		hash = rb_hash_new();
+		rb_hash_aset(hash, ID2SYM(rb_intern("kind")), ID2SYM(rb_intern(
+			rec->kind == RWIRE_CAPTURE_PUBLISHED ? "published" : "consumed")));
+		rb_hash_aset(hash, ID2SYM(rb_intern("offset")), LL2NUM(rec->offset));
+		rb_hash_aset(hash, ID2SYM(rb_intern("delivery_mode")), INT2FIX(rec->delivery_mode));
+		rb_hash_aset(hash, ID2SYM(rb_intern("priority")), INT2FIX(rec->priority));
+
+		data = (char *)(rec + 1);
+		for (i = 0; i < RWIRE_CAPTURE_FIELDS; i++) {
+			rb_hash_aset(hash, ID2SYM(rb_intern(rwire_capture_field_names[i])),
+				rb_str_new(data, rec->field_len[i]));
+			data += rec->field_len[i];
+		}
+		rb_hash_aset(hash, ID2SYM(rb_intern("body")), rb_str_new(data, rec->body_len));
+
+		rb_yield(hash);
+
+		// The block may have closed the reader
+		if (!reader->data)
+			break;
+		pos += rec->length;
+	}
+
+	return self;
+}
+
+static VALUE rwire_capture_reader_get_count(VALUE self)
+{
+	rwire_capture_record_t * rec = NULL;
+	size_t pos = sizeof(rwire_capture_header_t);
+	long count = 0;
+
+	CAPTURE_READER_GET;
+
+	while ((rec = rwire_capture_reader_record(reader, pos)) != NULL) {
+		pos += rec->length;
+		count++;
+	}
+	return LONG2NUM(count);
+}
+
+// Wall clock time the capture started, in nsecs since the epoch
+static VALUE rwire_capture_reader_get_started_at(VALUE self)
+{
+	CAPTURE_READER_GET;
+	return LL2NUM(((rwire_capture_header_t *)reader->data)->started_at);
+}
+
+static VALUE rwire_capture_reader_close(VALUE self)
+{
+	rwire_capture_reader_t * reader = NULL;
+	Data_Get_Struct(self, rwire_capture_reader_t, reader);
+	rwire_capture_reader_unmap(reader);
+	return self;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// Functions for RWire::RateLimiter
+//
+/////////////////////////////////////////////////////////////////////////////
+
+// Token buckets for messages and bytes per second.  A publisher that finds a
+// bucket short takes its tokens anyway, putting the bucket in debt, and then
+// sleeps until the debt would have been paid off.  Concurrent publishers thus
+// queue up behind each other instead of all waking at once.  A message
+// bigger than the byte bucket waits for a full bucket.  Limiters that fail
+// fast raise AMQRateLimitError instead of sleeping.
+
+typedef struct {
+	double rate;        // Tokens per second, 0 for no limit
+	double capacity;
+	double tokens;
+} rwire_bucket_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	rwire_bucket_t  messages;
+	rwire_bucket_t  bytes;
+	int64_t         updated;
+	bool            fail_fast;
+	int64_t         throttled;          // Nsecs publishers were told to wait
+	long            throttled_count;
+	long            rejected;
+} rwire_limiter_t;
+
+static ID id_rate_limiter;
+
+static void rwire_bucket_init(rwire_bucket_t *b, VALUE rate, double burst, double minimum)
+{
+	b->rate     = NIL_P(rate) ? 0 : NUM2DBL(rate);
+	b->capacity = b->rate * burst;
+	if (b->capacity < minimum)
+		b->capacity = minimum;
+	b->tokens   = b->capacity;
+
+	if (b->rate < 0)
+		rb_raise(rb_eArgError, "Rate can't be negative");
+}
+
+static void rwire_bucket_refill(rwire_bucket_t *b, double secs)
+{
+	if (b->rate > 0) {
+		b->tokens += b->rate * secs;
+		if (b->tokens > b->capacity)
+			b->tokens = b->capacity;
+	}
+}
+
+// Seconds until the bucket has n tokens, or a full bucket if n is bigger
+static double rwire_bucket_delay(rwire_bucket_t *b, double n)
+{
+	double want = n < b->capacity ? n : b->capacity;
+
+	if (b->rate <= 0 || b->tokens >= want)
+		return 0;
+	return (want - b->tokens) / b->rate;
+}
+
+static void rwire_bucket_take(rwire_bucket_t *b, double n)
+{
+	if (b->rate > 0)
+		b->tokens -= n;
+}
+
+static void rwire_limiter_free(void *p)
+{
+	rwire_limiter_t * rl = (rwire_limiter_t *)p;
+	pthread_mutex_destroy(&rl->lock);
+	free(rl);
+}
+
+static VALUE rwire_limiter_alloc(VALUE klass)
+{
+	rwire_limiter_t * rl = calloc(1, sizeof(rwire_limiter_t));
+	pthread_mutex_init(&rl->lock, NULL);
+	return Data_Wrap_Struct(klass, 0, rwire_limiter_free, rl);
+}
+
+// initialize(messages_per_sec, bytes_per_sec, burst, fail_fast).  Either
+// rate may be nil for no limit.  burst is how many seconds' worth of tokens
+// a bucket holds.
+static VALUE rwire_limiter_init(VALUE self, VALUE messages, VALUE bytes, VALUE burst, VALUE fail_fast)
+{
+	rwire_limiter_t * rl = NULL;
+	double _burst = NIL_P(burst) ? 0.1 : NUM2DBL(burst);
+
+	Data_Get_Struct(self, rwire_limiter_t, rl);
+	if (_burst <= 0)
+		rb_raise(rb_eArgError, "Burst must be positive");
+
+	rwire_bucket_init(&rl->messages, messages, _burst, 1);
+	rwire_bucket_init(&rl->bytes,    bytes,    _burst, 0);
+	rl->fail_fast = TO_BOOL(fail_fast);
+	rl->updated   = rwire_monotonic_ns();
+
+	return self;
+}
+
+// Take the tokens for one message of size bytes.  Returns the nsecs the
+// caller has to wait before sending it, or -1 if the limiter fails fast and
+// the message has to be dropped.
+static int64_t rwire_limiter_acquire(rwire_limiter_t *rl, size_t size)
+{
+	int64_t now, wait = 0;
+	double  delay, byte_delay;
+
+	pthread_mutex_lock(&rl->lock);
+
+	now = rwire_monotonic_ns();
+	rwire_bucket_refill(&rl->messages, (now - rl->updated) / 1e9);
+	rwire_bucket_refill(&rl->bytes,    (now - rl->updated) / 1e9);
+	rl->updated = now;
+
+	delay      = rwire_bucket_delay(&rl->messages, 1);
+	byte_delay = rwire_bucket_delay(&rl->bytes, size);
+	if (byte_delay > delay)
+		delay = byte_delay;
+
+	if (delay > 0 && rl->fail_fast) {
+		rl->rejected++;
+		wait = -1;
+	}
+	else {
+		rwire_bucket_take(&rl->messages, 1);
+		rwire_bucket_take(&rl->bytes, size);
+		if (delay > 0) {
+			wait = (int64_t)(delay * 1e9);
+			rl->throttled += wait;
+			rl->throttled_count++;
+		}
+	}
+
+	pthread_mutex_unlock(&rl->lock);
+
+	return wait;
+}
+
+// Hold back a publish of size bytes as the limiter says.  Sleeps without
+// blocking other threads, or raises AMQRateLimitError.
+static void rwire_limiter_wait(VALUE rb_rl, size_t size)
+{
+	rwire_limiter_t * rl = NULL;
+	int64_t wait;
+	struct timeval tv;
+
+	Data_Get_Struct(rb_rl, rwire_limiter_t, rl);
+	wait = rwire_limiter_acquire(rl, size);
+
+	if (wait < 0)
+		rb_raise(eAMQRateLimitError, "Publish rate limit exceeded");
+	if (wait > 0) {
+		tv.tv_sec  = wait / 1000000000;
+		tv.tv_usec = (wait % 1000000000) / 1000;
+		rb_thread_wait_for(tv);
+	}
+}
+
+static void rwire_session_throttle(VALUE r_session, size_t size)
+{
+	VALUE rb_rl = rb_ivar_get(r_session, id_rate_limiter);
+
+	if (!NIL_P(rb_rl))
+		rwire_limiter_wait(rb_rl, size);
+}
+
+// acquire(bytes), for publish paths outside this extension
+static VALUE rwire_limiter_acquire_rb(VALUE self, VALUE bytes)
+{
+	rwire_limiter_wait(self, NUM2SIZET(bytes));
+	return self;
+}
+
+// Total seconds publishers were held back
+static VALUE rwire_limiter_get_throttled_time(VALUE self)
+{
+	rwire_limiter_t * rl = NULL;
+	Data_Get_Struct(self, rwire_limiter_t, rl);
+	return rb_float_new(rl->throttled / 1e9);
+}
+
+static VALUE rwire_limiter_get_throttled_count(VALUE self)
+{
+	rwire_limiter_t * rl = NULL;
+	Data_Get_Struct(self, rwire_limiter_t, rl);
+	return LONG2NUM(rl->throttled_count);
+}
+
+static VALUE rwire_limiter_get_rejected_count(VALUE self)
+{
+	rwire_limiter_t * rl = NULL;
+	Data_Get_Struct(self, rwire_limiter_t, rl);
+	return LONG2NUM(rl->rejected);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// Functions for RWire::Session
+//
+/////////////////////////////////////////////////////////////////////////////
+
+static VALUE rwire_amq_client_session_get_error_text(VALUE self)
+{
+    amq_client_session_t *session = NULL;
+    SESSION_GET_STRUCT(self, session);
+    return rb_str_new2(session->error_text);
+}
+
+static VALUE rwire_amq_client_session_get_reply_text(VALUE self)
+{
+    amq_client_session_t *session = NULL;
+    SESSION_GET_STRUCT(self, session);
+    return rb_str_new2(session->reply_text);
+}
+
+static VALUE rwire_amq_client_session_get_reply_code(VALUE self)
+{
+    amq_client_session_t *session = NULL;
+    SESSION_GET_STRUCT(self, session);
+    return INT2FIX(session->reply_code);
+}
+
+static VALUE rwire_amq_client_session_get_queue(VALUE self)
+{
+    amq_client_session_t *session = NULL;
+    SESSION_GET_STRUCT(self, session);
+    return rb_str_new2(session->queue);
+}
+
+static VALUE rwire_amq_client_session_get_exchange(VALUE self)
+{
+    amq_client_session_t *session = NULL;
+    SESSION_GET_STRUCT(self, session);
+    return rb_str_new2(session->exchange);
+}
+
+static VALUE rwire_amq_client_session_get_message_count(VALUE self)
+{
+    amq_client_session_t *session = NULL;
+    SESSION_GET_STRUCT(self, session);
+    return INT2FIX(session->message_count);
+}
+
+static VALUE rwire_amq_client_session_destroy(VALUE self)
 {
-    int result;
     amq_client_session_t *session = NULL;
     Data_Get_Struct(self, amq_client_session_t, session);
-    if ( FIXNUM_P(timeout))
-    {
-      result = amq_client_session_wait(session, FIX2INT(timeout));
-      return (INT2FIX(result));
+    if (session) {
+        rwire_disown(session);
+        amq_client_session_destroy((amq_client_session_t**)&(DATA_PTR(self)));
+    }
+    return Qnil;
+}
+
+typedef struct {
+	amq_client_session_t *session;
+	int                   timeout;
+	int                   result;
+} rwire_session_wait_t;
+
+static void * rwire_session_wait_blocking(void *p)
+{
+	rwire_session_wait_t *w = (rwire_session_wait_t *)p;
+	w->result = amq_client_session_wait(w->session, w->timeout);
+	return NULL;
+}
+
+// Longest single WireAPI wait.  WireAPI can't be woken early, so this bounds
+// how long an interrupt (e.g. Thread#raise) goes unnoticed.
+#define RWIRE_WAIT_SLICE 250
+
+// Wait until contents arrive or are returned, the session dies, or the
+// timeout (msecs or an RWire::Deadline) passes.  0 or nil waits for as long
+// as it takes.  Returns 0 unless the session died.
+static VALUE rwire_amq_client_session_wait(VALUE self, VALUE timeout)
+{
+    rwire_session_wait_t w;
+    amq_client_session_t *session = NULL;
+    int64_t at = 0, started, took;
+    long left;
+    bool timed;
+
+    SESSION_GET_STRUCT(self, session);
+
+    timed = rwire_timeout_get(timeout, &at);
+
+    if (RWIRE_TRACED(wait__enter, RWIRE_EV_WAIT_ENTER)) {
+      left = timed ? rwire_deadline_left(at) : 0;
+      RWIRE_PROBE1(wait__enter, left);
+      rwire_hook_fire(RWIRE_EV_WAIT_ENTER, LONG2NUM(left), Qnil);
+    }
+    started = RWIRE_TRACE_START(wait__exit, RWIRE_EV_WAIT_EXIT);
+
+    w.session = session;
+    w.result  = 0;
+    for (;;) {
+      // Handed back contents are already here
+      if (rwire_session_held_count(self) > 0)
+        break;
+      w.timeout = RWIRE_WAIT_SLICE;
+      if (timed) {
+        left = rwire_deadline_left(at);
+        if (left == 0)
+          break;
+        if (left < w.timeout)
+          w.timeout = left;
+      }
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+      // Let other threads run while we block
+      rb_thread_call_without_gvl(rwire_session_wait_blocking, &w, NULL, NULL);
+#else
+      rwire_session_wait_blocking(&w);
+#endif
+
+      if (w.result != 0 ||
+          amq_client_session_get_basic_arrived_count(session) > 0 ||
+          amq_client_session_get_basic_returned_count(session) > 0)
+        break;
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+      rb_thread_check_ints();
+#endif
     }
-    else
-    {
-      rb_raise(rb_eTypeError, "Timeout was not an Fixnum");
+
+    if (started) {
+      took = rwire_monotonic_ns() - started;
+      RWIRE_PROBE2(wait__exit, w.result, took);
+      rwire_hook_fire(RWIRE_EV_WAIT_EXIT, INT2FIX(w.result), LL2NUM(took));
     }
+
+    return (INT2FIX(w.result));
+}
+
+// How long wait_active sleeps while contents are pending, since the session
+// wait would return at once
+#define RWIRE_FLOW_NAP 10
+
+static void * rwire_session_flow_blocking(void *p)
+{
+	rwire_session_wait_t *w = (rwire_session_wait_t *)p;
+	struct timespec nap;
+
+	if (amq_client_session_get_basic_arrived_count(w->session) > 0 ||
+		amq_client_session_get_basic_returned_count(w->session) > 0) {
+		if (w->timeout > RWIRE_FLOW_NAP)
+			w->timeout = RWIRE_FLOW_NAP;
+		nap.tv_sec  = 0;
+		nap.tv_nsec = w->timeout * 1000000L;
+		nanosleep(&nap, NULL);
+	}
+	else {
+		w->result = amq_client_session_wait(w->session, w->timeout);
+	}
+	return NULL;
+}
+
+// Wait until the broker lets the session publish again, for up to timeout
+// msecs or until an RWire::Deadline (forever if 0 or nil).  WireAPI has no flow
+// callback, but a channel.flow from the broker ends the session wait, so we
+// block there.  Returns true once the session is active, false on timeout or
+// if the session died.
+static VALUE rwire_amq_client_session_wait_active(VALUE self, VALUE timeout)
+{
+	rwire_session_wait_t w;
+	amq_client_session_t *session = NULL;
+	int64_t at = 0;
+	long left;
+	bool timed;
+
+	SESSION_GET_STRUCT(self, session);
+	timed = rwire_timeout_get(timeout, &at);
+
+	w.session = session;
+	w.result  = 0;
+	while (!amq_client_session_get_active(session)) {
+		w.timeout = RWIRE_WAIT_SLICE;
+		if (timed) {
+			left = rwire_deadline_left(at);
+			if (left == 0)
+				return Qfalse;
+			if (left < w.timeout)
+				w.timeout = left;
+		}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+		rb_thread_call_without_gvl(rwire_session_flow_blocking, &w, NULL, NULL);
+		rb_thread_check_ints();
+#else
+		rwire_session_flow_blocking(&w);
+#endif
+		if (w.result != 0)
+			return Qfalse;
+	}
+
+	return Qtrue;
+}
+
+// The arguments of amq_client_session_exchange_declare, for waiting on the
+// broker's answer without the GVL
+typedef struct {
+	amq_client_session_t * session;
+	char                 * exchange;
+	char                 * type;
+	bool                   passive;
+	bool                   durable;
+	bool                   undeletable;
+	bool                   internal;
+} rwire_declare_exchange_t;
+
+static void * rwire_declare_exchange_blocking(void *p)
+{
+	rwire_declare_exchange_t *d = (rwire_declare_exchange_t *)p;
+
+	amq_client_session_exchange_declare(d->session, 0, d->exchange, d->type,
+		d->passive, d->durable, d->undeletable, d->internal, NULL);
+	return NULL;
+}
+
+static VALUE rwire_amq_client_session_declare_exchange(
+	VALUE self,
+	VALUE exchange,
+	VALUE type,
+	VALUE passive,
+	VALUE durable,
+	VALUE undeletable,
+	VALUE internal)
+{
+    rwire_declare_exchange_t d;
+    amq_client_session_t *session = NULL;
+
+    // Frozen copies, as we wait without the GVL
+    exchange = rb_str_new_frozen(StringValue(exchange));
+    type     = rb_str_new_frozen(StringValue(type));
+    SESSION_GET_STRUCT(self, session);
+
+    d.session     = session;
+    d.exchange    = StringValuePtr(exchange);
+    d.type        = StringValuePtr(type);
+    d.passive     = RTEST(passive);
+    d.durable     = RTEST(durable);
+    d.undeletable = RTEST(undeletable);
+    d.internal    = RTEST(internal);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(rwire_declare_exchange_blocking, &d, NULL, NULL);
+#else
+    rwire_declare_exchange_blocking(&d);
+#endif
+    //TODO check for a more useful value to return
+    return self;
+}
+
+static VALUE rwire_amq_client_session_declare_queue(VALUE self,
+	VALUE queuename,
+	VALUE passive,
+	VALUE durable,
+	VALUE exclusive,
+	VALUE autodelete)
+{
+
+	char *_queuename              = NULL;
+	amq_client_session_t *session = NULL;
+
+	if (queuename != Qnil)
+		_queuename = StringValuePtr(queuename);
+
+	bool _passive    = (passive != Qfalse);
+	bool _durable    = (durable != Qfalse);
+	bool _exclusive  = (exclusive != Qfalse);
+	bool _autodelete = (autodelete != Qfalse);
+
+	SESSION_GET_STRUCT(self, session);
+	amq_client_session_queue_declare(session, 0,_queuename, _passive, _durable, _exclusive, _autodelete, NULL);
+//TODO check for a more useful value to return
+	return self;
+}
+
+static VALUE rwire_amq_client_session_delete_queue(VALUE self,
+	VALUE queuename,
+	VALUE if_unused,
+	VALUE if_empty)
+{
+
+	char *_queuename              = NULL;
+	amq_client_session_t *session = NULL;
+
+	if (queuename != Qnil)
+		_queuename = StringValuePtr(queuename);
+
+	bool _if_unused = (if_unused != Qfalse);
+	bool _if_empty  = (if_empty != Qfalse);
+
+	SESSION_GET_STRUCT(self, session);
+	amq_client_session_queue_delete(
+		session,
+		0,
+		_queuename,
+		_if_unused,
+		_if_empty);
+//TODO check for a more useful value to return
+	return self;
+}
+
+static VALUE rwire_amq_client_session_bind_queue(VALUE self,
+	VALUE queuename,
+	VALUE exchange,
+	VALUE routing_key)
+{
+    amq_client_session_t *session = NULL;
+    char *_queuename = NULL;
+    char *_exchange = StringValuePtr(exchange);
+    char *_routing_key = StringValuePtr(routing_key);
+
+	if (queuename != Qnil)
+		_queuename = StringValuePtr(queuename);
+
+    SESSION_GET_STRUCT(self, session);
+    amq_client_session_queue_bind(session, 0, _queuename, _exchange, _routing_key, NULL);
+    //TODO check for a more useful value to return
+    return self;
+}
+
+static VALUE rwire_amq_client_session_consume(VALUE self,
+	VALUE queuename,
+	VALUE consumer_tag,
+	VALUE no_local,
+	VALUE no_ack,
+	VALUE exclusive)
+{
+	int result;
+	amq_client_session_t *session = NULL;
+	char *_queuename              = NULL;
+	char *_consumer_tag           = NULL;
+	bool _no_local   = (no_local != Qfalse);
+	bool _no_ack     = (no_ack != Qfalse);
+	bool _exclusive  = (exclusive != Qfalse);
+
+	if (queuename != Qnil)
+		_queuename = StringValuePtr(queuename);
+
+	if (consumer_tag != Qnil)
+		_consumer_tag = StringValuePtr(consumer_tag);
+
+
+	SESSION_GET_STRUCT(self, session);
+	result = amq_client_session_basic_consume(session, 0, _queuename, _consumer_tag, _no_local, _no_ack, _exclusive, NULL);
+//TODO check for a more useful value to return
+	return self;
+}
+
+static VALUE rwire_amq_client_session_basic_ack(VALUE self,
+	VALUE delivery_tag,
+	VALUE multiple)
+{
+	amq_client_session_t *session = NULL;
+
+	SESSION_GET_STRUCT(self, session);
+
+	if (amq_client_session_basic_ack(session, NUM2LL(delivery_tag), TO_BOOL(multiple)))
+		rb_raise(eAMQError, "Failed to acknowledge message");
+
+	return self;
+}
+
+static VALUE rwire_amq_client_session_basic_cancel(VALUE self,
+	VALUE consumer_tag)
+{
+	int result;
+	amq_client_session_t *session = NULL;
+	char *_consumer_tag           = NULL;
+
+	if (consumer_tag != Qnil)
+		_consumer_tag = StringValuePtr(consumer_tag);
+
+
+	SESSION_GET_STRUCT(self, session);
+	if (RWIRE_TRACED(cancel, RWIRE_EV_CANCEL)) {
+		RWIRE_PROBE1(cancel, _consumer_tag);
+		rwire_hook_fire(RWIRE_EV_CANCEL, consumer_tag, Qnil);
+	}
+	result = amq_client_session_basic_cancel(session, _consumer_tag);
+	fprintf(stderr, "amq_client_session_basic_cancel returns %d\n", result);
+//TODO check for a more useful value to return
+	return self;
+}
+
+
+static VALUE rwire_amq_client_session_publish_body(VALUE self,
+	VALUE body,
+	VALUE exchange,
+	VALUE routing_key,
+        VALUE r_mandatory,
+        VALUE r_immediate,
+        VALUE r_reply_to)
+{
+	char * exch = NULL;
+	char * rkey = NULL;
+	char * reply_to = NULL;
+
+	bool mandatory = TO_BOOL(r_mandatory);
+	bool immediate = TO_BOOL(r_immediate);
+
+    	amq_client_session_t * session = NULL;
+	amq_content_basic_t *  content = NULL;
+	rwire_capture_t     *  cap     = NULL;
+
+	if (!NIL_P(exchange)) {
+		exch = StringValuePtr(exchange);
+	}
+
+	if (!NIL_P(routing_key)) {
+		rkey = StringValuePtr(routing_key);
+	}
+
+	if (!NIL_P(r_reply_to)) {
+		reply_to = StringValuePtr(r_reply_to);
+	}
+
+	SESSION_GET_STRUCT(self, session);
+
+	StringValue(body);
+	rwire_session_throttle(self, RSTRING_LEN(body));
+	content = amq_content_basic_new();
+
+	int rc = 0;
+	char * errmsg = NULL;
+
+	do {
+		char * blob = new_blob_from_rb_str(body);
+		int    size = RSTRING_LEN(body);
+
+		// Set the content body
+		rc = amq_content_basic_set_body(content, blob, size, free);
+		if (rc) {
+			errmsg = "Unable to set content body";
+			break;
+		}
+
+		// Set the reply_to field if passed in
+		if (reply_to) {
+			rc = amq_content_basic_set_reply_to(content, reply_to);
+			if (rc) {
+				errmsg = "Unable to set reply_to field";
+				break;
+			}
+
+		}
+
+		// Publish
+		rc = rwire_basic_publish(session, content, exch, rkey, mandatory, immediate);
+		if (rc) {
+			errmsg = "Failed to publish message";
+			break;
+		}
+
+		if ((cap = rwire_session_capture(self)) != NULL) {
+			rwire_capture_write(cap, RWIRE_CAPTURE_PUBLISHED, content, exch, rkey,
+				RSTRING_PTR(body), RSTRING_LEN(body));
+		}
+	} while (false);
+
+	if (content) {
+		amq_content_basic_unlink(&content);
+	}
+	if (rc) {
+		rb_raise(eAMQError, errmsg);
+	}
+	RWIRE_HOOKS_FLUSH();
+
+	//TODO check for a more useful value to return
+	return self;
+}
+
+static VALUE rwire_amq_client_session_publish_content(VALUE self,
+	VALUE r_content,
+	VALUE exchange,
+	VALUE routing_key,
+        VALUE r_mandatory,
+        VALUE r_immediate)
+{
+	char * exch = NULL;
+	char * rkey = NULL;
+
+	bool mandatory = TO_BOOL(r_mandatory);
+	bool immediate = TO_BOOL(r_immediate);
+
+    	amq_client_session_t * session = NULL;
+	amq_content_basic_t  * content = NULL;
+	rwire_capture_t      * cap     = NULL;
+
+	if (!NIL_P(exchange)) {
+		exch = StringValuePtr(exchange);
+	}
+
+	if (!NIL_P(routing_key)) {
+		rkey = StringValuePtr(routing_key);
+	}
+
+	SESSION_GET_STRUCT(self, session);
+	Data_Get_Struct(r_content, amq_content_basic_t, content);
+
+	rwire_session_throttle(self, amq_content_basic_get_body_size(content));
+
+	int rc = 0;
+	do {
+		rc = rwire_basic_publish(session, content, exch, rkey, mandatory, immediate);
+		if (rc) {
+			rb_raise(eAMQError, "Failed to publish message");
+		}
+
+		if ((cap = rwire_session_capture(self)) != NULL) {
+			rwire_capture_content(cap, RWIRE_CAPTURE_PUBLISHED, content, exch, rkey);
+		}
+	} while (false);
+	RWIRE_HOOKS_FLUSH();
+
+	return self;
+}
+
+static VALUE rwire_amq_client_session_basic_get(VALUE self, VALUE queuename)
+{
+	char *_queuename              = NULL;
+	amq_client_session_t *session = NULL;
+
+	if (queuename != Qnil)
+		_queuename = StringValuePtr(queuename);
+
+	SESSION_GET_STRUCT(self, session);
+
+	int rc = amq_client_session_basic_get(session,0, _queuename, 0);
+
+	if (rc)
+	{
+		rb_raise(eAMQError, "Failed to basic get");
+	}
+
+	return self;
+}
+
+static VALUE rwire_amq_client_session_get_basic_arrived(VALUE self)
+{
+	VALUE rb_content;
+	amq_client_session_t * session = NULL;
+	amq_content_basic_t  * content = NULL;
+
+	SESSION_GET_STRUCT(self, session);
+
+	content = rwire_session_arrived(self, session, rwire_session_capture(self), NULL);
+
+	if (content)
+	{
+		rb_content = Data_Wrap_Struct(cContent, 0, rwire_amq_content_basic_free, content);
+		RWIRE_HOOKS_FLUSH();
+		return rb_content;
+	}
+	else
+		return Qnil;
+
+}
+
+static VALUE rwire_amq_client_session_get_basic_arrived_count(VALUE self)
+{
+	amq_client_session_t * session = NULL;
+
+	SESSION_GET_STRUCT(self, session);
+
+	long rc = amq_client_session_get_basic_arrived_count(session) +
+		rwire_session_held_count(self);
+
+	return LONG2NUM(rc);
+}
+
+static VALUE rwire_amq_client_session_get_basic_returned(VALUE self)
+{
+	VALUE rb_content;
+	amq_client_session_t * session = NULL;
+	amq_content_basic_t  * content = NULL;
+
+	SESSION_GET_STRUCT(self, session);
+
+	content = amq_client_session_basic_returned(session);
+
+	if (content)
+	{
+		rb_content = Data_Wrap_Struct(cContent, 0, rwire_amq_content_basic_free, content);
+		return rb_content;
+	}
+	else
+		return Qnil;
+
+}
+
+static VALUE rwire_amq_client_session_get_basic_returned_count(VALUE self)
+{
+	amq_client_session_t * session = NULL;
+
+	SESSION_GET_STRUCT(self, session);
+
+	int rc = amq_client_session_get_basic_returned_count(session);
+
+	return INT2FIX(rc);
+}
+
+
+static VALUE rwire_amq_client_session_get_consumer_tag(VALUE self)
+{
+	amq_client_session_t * session = NULL;
+
+	SESSION_GET_STRUCT(self, session);
+
+	char * tag = amq_client_session_get_consumer_tag(session);
+
+	return rb_str_new2(tag);
+}
+
+// Attach an RWire::Capture that records every message published or consumed
+// on this session, or detach it with nil
+static VALUE rwire_amq_client_session_set_capture(VALUE self, VALUE capture)
+{
+	if (!NIL_P(capture) && !rb_obj_is_kind_of(capture, cCapture))
+		rb_raise(rb_eTypeError, "Capture was not an RWire::Capture");
+	rb_ivar_set(self, id_capture, capture);
+	return capture;
+}
+
+static VALUE rwire_amq_client_session_get_capture(VALUE self)
+{
+	return rb_ivar_get(self, id_capture);
+}
+
+// Attach an RWire::RateLimiter that every publish on this session has to go
+// through, or detach it with nil.  One limiter can be shared by sessions.
+static VALUE rwire_amq_client_session_set_rate_limiter(VALUE self, VALUE limiter)
+{
+	if (!NIL_P(limiter) && !rb_obj_is_kind_of(limiter, cRateLimiter))
+		rb_raise(rb_eTypeError, "Rate limiter was not an RWire::RateLimiter");
+	rb_ivar_set(self, id_rate_limiter, limiter);
+	return limiter;
+}
+
+static VALUE rwire_amq_client_session_get_rate_limiter(VALUE self)
+{
+	return rb_ivar_get(self, id_rate_limiter);
+}
+
+// Ask the broker to stop (false) or resume (true) sending us contents
+static VALUE rwire_amq_client_session_channel_flow(VALUE self, VALUE active)
+{
+	amq_client_session_t * session = NULL;
+
+	SESSION_GET_STRUCT(self, session);
+
+	if (amq_client_session_channel_flow(session, TO_BOOL(active)))
+		rb_raise(eAMQError, "Failed to change channel flow");
+
+	return self;
+}
+
+// False while the broker has asked us to stop publishing
+static VALUE rwire_amq_client_session_get_active(VALUE self)
+{
+	amq_client_session_t * session = NULL;
+
+	SESSION_GET_STRUCT(self, session);
+
+	return (amq_client_session_get_active(session) ? Qtrue : Qfalse);
+}
+
+static VALUE rwire_amq_client_session_get_alive(VALUE self)
+{
+	amq_client_session_t * session = NULL;
+
+	Data_Get_Struct(self, amq_client_session_t, session);
+
+	bool alive = session && amq_client_session_get_alive(session);
+
+	return (alive ? Qtrue : Qfalse);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// Functions for RWire::Publisher
+//
+/////////////////////////////////////////////////////////////////////////////
+
+// A publisher for messages that only differ in their body.  Exchange, routing
+// key and properties are resolved into C strings once, when the publisher is
+// created, so each call only has to copy the body.
+
+typedef int (*rwire_string_setter_t)(amq_content_basic_t *, char *);
+
+typedef struct {
+	rwire_string_setter_t set;
+	char                 *value;
+} rwire_string_property_t;
+
+#define RWIRE_PUBLISHER_MAX_PROPERTIES 8
+
+typedef struct {
+	VALUE                    session;
+	char                    *exchange;
+	char                    *routing_key;
+	bool                     mandatory;
+	bool                     immediate;
+	rwire_string_property_t  strings[RWIRE_PUBLISHER_MAX_PROPERTIES];
+	int                      string_count;
+	int                      delivery_mode;
+	int                      priority;
+} rwire_publisher_t;
+
+static void rwire_publisher_mark(void *p)
+{
+	rwire_publisher_t * pub = (rwire_publisher_t *)p;
+	rb_gc_mark(pub->session);
+}
+
+static void rwire_publisher_free(void *p)
+{
+	rwire_publisher_t * pub = (rwire_publisher_t *)p;
+	int i;
+
+	for (i = 0; i < pub->string_count; i++)
+		free(pub->strings[i].value);
+	free(pub->exchange);
+	free(pub->routing_key);
+	free(pub);
+}
+
+static VALUE rwire_publisher_alloc(VALUE klass)
+{
+	rwire_publisher_t * pub = calloc(1, sizeof(rwire_publisher_t));
+	pub->session = Qnil;
+	return Data_Wrap_Struct(klass, rwire_publisher_mark, rwire_publisher_free, pub);
+}
+
+static char * rwire_strdup_or_null(VALUE rstr)
+{
+	return NIL_P(rstr) ? NULL : strdup(StringValuePtr(rstr));
+}
+
+// Remember a string property of the template if it is set
+static void rwire_publisher_keep(rwire_publisher_t *pub, rwire_string_setter_t set, char *value)
+{
+	if (value && *value && pub->string_count < RWIRE_PUBLISHER_MAX_PROPERTIES) {
+		pub->strings[pub->string_count].set   = set;
+		pub->strings[pub->string_count].value = strdup(value);
+		pub->string_count++;
+	}
+}
+
+static VALUE rwire_publisher_init(VALUE self,
+	VALUE r_session,
+	VALUE r_template,
+	VALUE exchange,
+	VALUE routing_key,
+	VALUE r_mandatory,
+	VALUE r_immediate)
+{
+	rwire_publisher_t    * pub      = NULL;
+	amq_client_session_t * session  = NULL;
+	amq_content_basic_t  * template = NULL;
+
+	Data_Get_Struct(self, rwire_publisher_t, pub);
+	SESSION_ARG_GET_STRUCT(r_session, session);
+
+	pub->session     = r_session;
+	pub->exchange    = rwire_strdup_or_null(exchange);
+	pub->routing_key = rwire_strdup_or_null(routing_key);
+	pub->mandatory   = TO_BOOL(r_mandatory);
+	pub->immediate   = TO_BOOL(r_immediate);
+
+	if (!NIL_P(r_template)) {
+		Data_Get_Struct(r_template, amq_content_basic_t, template);
+	}
+	if (template) {
+		rwire_publisher_keep(pub, amq_content_basic_set_app_id,           amq_content_basic_get_app_id(template));
+		rwire_publisher_keep(pub, amq_content_basic_set_content_encoding, amq_content_basic_get_content_encoding(template));
+		rwire_publisher_keep(pub, amq_content_basic_set_content_type,     amq_content_basic_get_content_type(template));
+		rwire_publisher_keep(pub, amq_content_basic_set_correlation_id,   amq_content_basic_get_correlation_id(template));
+		rwire_publisher_keep(pub, amq_content_basic_set_expiration,       amq_content_basic_get_expiration(template));
+		rwire_publisher_keep(pub, amq_content_basic_set_reply_to,         amq_content_basic_get_reply_to(template));
+		rwire_publisher_keep(pub, amq_content_basic_set_user_id,          amq_content_basic_get_user_id(template));
+		pub->delivery_mode = amq_content_basic_get_delivery_mode(template);
+		pub->priority      = amq_content_basic_get_priority(template);
+	}
+
+	return self;
+}
+
+// Copy the prepared properties onto a new content
+static int rwire_publisher_apply(rwire_publisher_t *pub, amq_content_basic_t *content)
+{
+	int i;
+
+	for (i = 0; i < pub->string_count; i++) {
+		if (pub->strings[i].set(content, pub->strings[i].value))
+			return -1;
+	}
+	if (pub->delivery_mode)
+		amq_content_basic_set_delivery_mode(content, pub->delivery_mode);
+	if (pub->priority)
+		amq_content_basic_set_priority(content, pub->priority);
+
+	return 0;
+}
+
+static VALUE rwire_publisher_call(VALUE self, VALUE body)
+{
+	rwire_publisher_t    * pub     = NULL;
+	amq_client_session_t * session = NULL;
+	amq_content_basic_t  * content = NULL;
+	rwire_capture_t      * cap     = NULL;
+
+	int rc = 0;
+	char * errmsg = NULL;
+
+	Data_Get_Struct(self, rwire_publisher_t, pub);
+	if (NIL_P(pub->session))
+		rb_raise(eAMQError, "Publisher is not initialized");
+	SESSION_GET_STRUCT(pub->session, session);
+	StringValue(body);
+
+	rwire_session_throttle(pub->session, RSTRING_LEN(body));
+	content = amq_content_basic_new();
+
+	do {
+		rc = amq_content_basic_set_body(content, new_blob_from_rb_str(body), RSTRING_LEN(body), free);
+		if (rc) {
+			errmsg = "Unable to set content body";
+			break;
+		}
+
+		rc = rwire_publisher_apply(pub, content);
+		if (rc) {
+			errmsg = "Unable to set content properties";
+			break;
+		}
+
+		rc = rwire_basic_publish(session, content,
+			pub->exchange, pub->routing_key, pub->mandatory, pub->immediate);
+		if (rc) {
+			errmsg = "Failed to publish message";
+			break;
+		}
+
+		if ((cap = rwire_session_capture(pub->session)) != NULL) {
+			rwire_capture_write(cap, RWIRE_CAPTURE_PUBLISHED, content,
+				pub->exchange, pub->routing_key, RSTRING_PTR(body), RSTRING_LEN(body));
+		}
+	} while (false);
+
+	amq_content_basic_unlink(&content);
+	if (rc) {
+		rb_raise(eAMQError, errmsg);
+	}
+	RWIRE_HOOKS_FLUSH();
+
+	return self;
+}
+
+static VALUE rwire_publisher_get_exchange(VALUE self)
+{
+	rwire_publisher_t * pub = NULL;
+	Data_Get_Struct(self, rwire_publisher_t, pub);
+	return pub->exchange ? rb_str_new2(pub->exchange) : Qnil;
+}
+
+static VALUE rwire_publisher_get_routing_key(VALUE self)
+{
+	rwire_publisher_t * pub = NULL;
+	Data_Get_Struct(self, rwire_publisher_t, pub);
+	return pub->routing_key ? rb_str_new2(pub->routing_key) : Qnil;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// Content FIFO and message keys shared by the native content buffers
+//
+/////////////////////////////////////////////////////////////////////////////
+
+// Doubly linked list of contents.  The list owns one link on every content it
+// holds; whoever takes a content out becomes responsible for unlinking it.
+typedef struct rwire_fifo_node_s {
+	amq_content_basic_t      *content;
+	void                     *data;     // Owner's bookkeeping, NULL when pushed
+	struct rwire_fifo_node_s *prev;
+	struct rwire_fifo_node_s *next;
+} rwire_fifo_node_t;
+
+typedef struct {
+	rwire_fifo_node_t *head;
+	rwire_fifo_node_t *tail;
+	long               size;
+} rwire_fifo_t;
+
+// Link a node, and with it its content, onto the end of the list
+static void rwire_fifo_append(rwire_fifo_t *fifo, rwire_fifo_node_t *node)
+{
+	node->next = NULL;
+	node->prev = fifo->tail;
+	if (fifo->tail)
+		fifo->tail->next = node;
+	else
+		fifo->head = node;
+	fifo->tail = node;
+	fifo->size++;
+}
+
+// Unlink the first node without freeing it, so it can be appended elsewhere
+static rwire_fifo_node_t * rwire_fifo_detach(rwire_fifo_t *fifo)
+{
+	rwire_fifo_node_t *node = fifo->head;
+
+	if (node) {
+		fifo->head = node->next;
+		if (fifo->head)
+			fifo->head->prev = NULL;
+		else
+			fifo->tail = NULL;
+		fifo->size--;
+	}
+	return node;
+}
+
+static rwire_fifo_node_t * rwire_fifo_push(rwire_fifo_t *fifo, amq_content_basic_t *content)
+{
+	rwire_fifo_node_t *node = malloc(sizeof(rwire_fifo_node_t));
+
+	node->content = content;
+	node->data    = NULL;
+	rwire_fifo_append(fifo, node);
+
+	return node;
+}
+
+static amq_content_basic_t * rwire_fifo_remove(rwire_fifo_t *fifo, rwire_fifo_node_t *node)
+{
+	amq_content_basic_t *content = node->content;
+
+	if (node->prev)
+		node->prev->next = node->next;
+	else
+		fifo->head = node->next;
+	if (node->next)
+		node->next->prev = node->prev;
+	else
+		fifo->tail = node->prev;
+	fifo->size--;
+	free(node);
+
+	return content;
+}
+
+static amq_content_basic_t * rwire_fifo_shift(rwire_fifo_t *fifo)
+{
+	return fifo->head ? rwire_fifo_remove(fifo, fifo->head) : NULL;
+}
+
+static amq_content_basic_t * rwire_fifo_pop(rwire_fifo_t *fifo)
+{
+	return fifo->tail ? rwire_fifo_remove(fifo, fifo->tail) : NULL;
+}
+
+static void rwire_fifo_clear(rwire_fifo_t *fifo)
+{
+	amq_content_basic_t *content = NULL;
+
+	while ((content = rwire_fifo_shift(fifo)) != NULL) {
+		amq_content_basic_unlink(&content);
+	}
+}
+
+// Longest key we look at.  Routing keys and message ids are AMQP short
+// strings so they always fit; longer header values are truncated.
+#define RWIRE_KEY_MAX 256
+
+typedef enum {
+	RWIRE_KEY_NONE = 0,
+	RWIRE_KEY_ROUTING_KEY,
+	RWIRE_KEY_MESSAGE_ID,
+	RWIRE_KEY_HEADER
+} rwire_key_type_t;
+
+typedef struct {
+	rwire_key_type_t type;
+	int              prefix;    // Only the first prefix bytes count, if set
+	char             header[RWIRE_KEY_MAX];
+} rwire_key_t;
+
+// A key is given from Ruby as nil (no key), :routing_key, :message_id or a
+// String naming a header field.  [key, n] only looks at the first n bytes.
+static void rwire_key_parse(rwire_key_t *key, VALUE spec)
+{
+	VALUE prefix = Qnil;
+
+	memset(key, 0, sizeof(rwire_key_t));
+
+	if (TYPE(spec) == T_ARRAY) {
+		prefix = rb_ary_entry(spec, 1);
+		spec   = rb_ary_entry(spec, 0);
+	}
+
+	if (NIL_P(spec))
+		return;
+
+	if (!NIL_P(prefix)) {
+		key->prefix = NUM2INT(prefix);
+		if (key->prefix < 1)
+			rb_raise(rb_eArgError, "Key prefix length must be positive");
+	}
+
+	if (SYMBOL_P(spec)) {
+		ID id = SYM2ID(spec);
+		if (id == rb_intern("routing_key"))
+			key->type = RWIRE_KEY_ROUTING_KEY;
+		else if (id == rb_intern("message_id"))
+			key->type = RWIRE_KEY_MESSAGE_ID;
+		else
+			rb_raise(rb_eArgError, "Unknown message key :%s", rb_id2name(id));
+	}
+	else {
+		char * name = StringValuePtr(spec);
+		if (RSTRING_LEN(spec) == 0 || RSTRING_LEN(spec) >= RWIRE_KEY_MAX)
+			rb_raise(rb_eArgError, "Invalid header name for message key");
+		strcpy(key->header, name);
+		key->type = RWIRE_KEY_HEADER;
+	}
+}
+
+// Copy the key of a content into buf, which must hold RWIRE_KEY_MAX bytes.
+// Returns the key length, or -1 if the content doesn't carry the key.
+static int rwire_key_extract(rwire_key_t *key, amq_content_basic_t *content, char *buf)
+{
+	char             *value  = NULL;
+	asl_field_list_t *fields = NULL;
+	asl_field_t      *field  = NULL;
+	int               len    = -1;
+
+	switch (key->type) {
+	case RWIRE_KEY_ROUTING_KEY:
+		value = amq_content_basic_get_routing_key(content);
+		break;
+	case RWIRE_KEY_MESSAGE_ID:
+		value = amq_content_basic_get_message_id(content);
+		break;
+	case RWIRE_KEY_HEADER:
+		if (amq_content_basic_get_headers(content))
+			fields = asl_field_list_new(amq_content_basic_get_headers(content));
+		if (fields)
+			field = asl_field_list_search(fields, key->header);
+		if (field)
+			value = asl_field_string(field);
+		break;
+	default:
+		break;
+	}
+
+	if (value) {
+		len = strlen(value);
+		if (key->prefix && len > key->prefix)
+			len = key->prefix;
+		if (len >= RWIRE_KEY_MAX)
+			len = RWIRE_KEY_MAX - 1;
+		memcpy(buf, value, len);
+		buf[len] = '\0';
+	}
+
+	if (field)
+		asl_field_unlink(&field);
+	if (fields)
+		asl_field_list_unlink(&fields);
+
+	return len;
+}
+
+// 64-bit FNV-1a
+static uint64_t rwire_hash(const char *data, size_t len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	size_t   i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// Condition variables time out on the monotonic clock where the platform
+// lets us choose (not on Mac OS X), so that setting the wall clock doesn't
+// stretch or cut short a timed wait.
+static void rwire_cond_init(pthread_cond_t *cond)
+{
+#if defined(HAVE_PTHREAD_CONDATTR_SETCLOCK) && defined(CLOCK_MONOTONIC)
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+#else
+	pthread_cond_init(cond, NULL);
+#endif
+}
+
+// The monotonic deadline at as pthread_cond_timedwait wants it, for a
+// condition variable made by rwire_cond_init
+static void rwire_abstime(struct timespec *ts, int64_t at)
+{
+#if defined(HAVE_PTHREAD_CONDATTR_SETCLOCK) && defined(CLOCK_MONOTONIC)
+	ts->tv_sec  = at / 1000000000;
+	ts->tv_nsec = at % 1000000000;
+#else
+	struct timeval now;
+	int64_t left = at - rwire_monotonic_ns(), abs;
+
+	gettimeofday(&now, NULL);
+	abs = (int64_t)now.tv_sec * 1000000000 + (int64_t)now.tv_usec * 1000 +
+		(left > 0 ? left : 0);
+	ts->tv_sec  = abs / 1000000000;
+	ts->tv_nsec = abs % 1000000000;
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// Functions for RWire::Dispatcher
+//
+/////////////////////////////////////////////////////////////////////////////
+
+// Spreads arrived contents over a fixed number of worker queues.  A keyed
+// dispatcher pins every key to one worker so that its contents are handled in
+// order.  An unkeyed one hands each content to the shortest queue, and idle
+// workers steal from the tail of the longest.
+//
+// The workers are either Ruby threads calling take, or native threads
+// started with a built-in handler.  Native workers run the handler on each
+// body without the interpreter lock, so they use every core, and queue the
+// content with its result for collect to hand to Ruby.
+
+typedef enum {
+	RWIRE_HANDLER_NONE = 0,
+	RWIRE_HANDLER_HASH,         // 64-bit FNV-1a of the body
+	RWIRE_HANDLER_CRC32,        // CRC-32 of the body, as Zlib.crc32
+	RWIRE_HANDLER_INFLATE       // The body inflated, zlib or gzip
+} rwire_handler_t;
+
+// What a native worker made of a content
+typedef struct {
+	uint64_t     value;
+	char       * data;          // Malloc'ed, for handlers that return bytes
+	size_t       len;
+	const char * error;         // A static message if the handler failed
+} rwire_handler_result_t;
+
+struct rwire_dispatcher_s;
+
+typedef struct {
+	struct rwire_dispatcher_s *d;
+	int                        worker;
+	pthread_t                  thread;
+} rwire_native_worker_t;
+
+typedef struct rwire_dispatcher_s {
+	pthread_mutex_t lock;
+	pthread_cond_t  ready;
+	rwire_fifo_t   *queues;
+	int             workers;
+	int             next;
+	rwire_key_t     key;
+	bool            closed;
+	long            dispatched;
+	long            stolen;
+
+	// Native workers
+	rwire_handler_t        handler;
+	rwire_native_worker_t *natives;
+	int                    started;     // Native workers with a thread
+	int                    running;     // Native workers not yet finished
+	rwire_fifo_t           done;        // Handled contents, result in data
+	pthread_cond_t         collected;   // Signalled as done grows or running drops
+} rwire_dispatcher_t;
+
+#define DISPATCHER_GET \
+	rwire_dispatcher_t * d = NULL;\
+	Data_Get_Struct(self, rwire_dispatcher_t, d);\
+	if (!d->queues)\
+		rb_raise(eAMQError, "Dispatcher is not initialized")
+
+static void rwire_handler_result_free(rwire_handler_result_t *r)
+{
+	if (r) {
+		free(r->data);
+		free(r);
+	}
+}
+
+static void rwire_dispatcher_join(rwire_dispatcher_t *d);
+
+static void rwire_dispatcher_free(void *p)
+{
+	rwire_dispatcher_t * d = (rwire_dispatcher_t *)p;
+	rwire_fifo_node_t  * node;
+	int i;
+
+	if (d->queues) {
+		if (d->natives) {
+			pthread_mutex_lock(&d->lock);
+			d->closed = true;
+			pthread_cond_broadcast(&d->ready);
+			pthread_mutex_unlock(&d->lock);
+			rwire_dispatcher_join(d);
+		}
+		while ((node = rwire_fifo_detach(&d->done)) != NULL) {
+			rwire_handler_result_free(node->data);
+			amq_content_basic_unlink(&node->content);
+			free(node);
+		}
+		for (i = 0; i < d->workers; i++)
+			rwire_fifo_clear(&d->queues[i]);
+		free(d->queues);
+		pthread_cond_destroy(&d->collected);
+		pthread_cond_destroy(&d->ready);
+		pthread_mutex_destroy(&d->lock);
+	}
+	free(d);
+}
+
+static VALUE rwire_dispatcher_alloc(VALUE klass)
+{
+	rwire_dispatcher_t * d = calloc(1, sizeof(rwire_dispatcher_t));
+	return Data_Wrap_Struct(klass, 0, rwire_dispatcher_free, d);
+}
+
+static VALUE rwire_dispatcher_init(VALUE self, VALUE workers, VALUE key)
+{
+	rwire_dispatcher_t * d = NULL;
+	int _workers = NUM2INT(workers);
+
+	Data_Get_Struct(self, rwire_dispatcher_t, d);
+	if (d->queues)
+		rb_raise(eAMQError, "Dispatcher is already initialized");
+	if (_workers < 1)
+		rb_raise(rb_eArgError, "Dispatcher needs at least one worker");
+
+	rwire_key_parse(&d->key, key);
+	d->workers = _workers;
+	d->queues  = calloc(_workers, sizeof(rwire_fifo_t));
+	pthread_mutex_init(&d->lock, NULL);
+	rwire_cond_init(&d->ready);
+	rwire_cond_init(&d->collected);
+
+	return self;
+}
+
+// Must be called with the dispatcher lock held
+static int rwire_dispatcher_shortest(rwire_dispatcher_t *d)
+{
+	int i, queue, best;
+
+	// Start from a rotating worker so that ties don't all land on one queue
+	best = d->next = (d->next + 1) % d->workers;
+	for (i = 1; i < d->workers; i++) {
+		queue = (d->next + i) % d->workers;
+		if (d->queues[queue].size < d->queues[best].size)
+			best = queue;
+	}
+	return best;
+}
+
+// Must be called with the dispatcher lock held
+static amq_content_basic_t * rwire_dispatcher_next(rwire_dispatcher_t *d, int worker)
+{
+	amq_content_basic_t * content = rwire_fifo_shift(&d->queues[worker]);
+	int i, victim = -1;
+
+	// Stealing would break per-key order, so keyed workers only serve their
+	// own queue
+	if (content || d->key.type != RWIRE_KEY_NONE)
+		return content;
+
+	for (i = 0; i < d->workers; i++) {
+		if (d->queues[i].size > 0 &&
+			(victim < 0 || d->queues[i].size > d->queues[victim].size))
+			victim = i;
+	}
+	if (victim >= 0) {
+		content = rwire_fifo_pop(&d->queues[victim]);
+		d->stolen++;
+	}
+	return content;
+}
+
+// Move every content that has arrived on the session into the worker queues.
+// Returns the number of contents dispatched.
+static VALUE rwire_dispatcher_pull(VALUE self, VALUE r_session)
+{
+	amq_client_session_t * session = NULL;
+	amq_content_basic_t  * content = NULL;
+	rwire_capture_t      * cap     = NULL;
+	rwire_fifo_node_t    * node    = NULL;
+	rwire_fifo_t batch = { NULL, NULL, 0 };
+	char key[RWIRE_KEY_MAX];
+	long count = 0;
+	int  len;
+
+	DISPATCHER_GET;
+	SESSION_ARG_GET_STRUCT(r_session, session);
+	cap = rwire_session_capture(r_session);
+
+	// Capture and hash the keys before taking the lock, so that workers only
+	// wait on us for the queue updates.  A keyed content remembers its worker
+	// plus one in the node, zero means the shortest queue.
+	while ((content = rwire_session_arrived(r_session, session, cap, NULL)) != NULL) {
+		node = rwire_fifo_push(&batch, content);
+		if (d->key.type != RWIRE_KEY_NONE &&
+			(len = rwire_key_extract(&d->key, content, key)) >= 0)
+			node->data = (void *)(uintptr_t)(rwire_hash(key, len) % d->workers + 1);
+	}
+	if (!batch.size)
+		return INT2FIX(0);
+
+	pthread_mutex_lock(&d->lock);
+	while ((node = rwire_fifo_detach(&batch)) != NULL) {
+		rwire_fifo_append(&d->queues[node->data ?
+			(int)((uintptr_t)node->data - 1) : rwire_dispatcher_shortest(d)], node);
+		node->data = NULL;
+		count++;
+	}
+	d->dispatched += count;
+	pthread_cond_broadcast(&d->ready);
+	pthread_mutex_unlock(&d->lock);
+	RWIRE_HOOKS_FLUSH();
+
+	return LONG2NUM(count);
+}
+
+typedef struct {
+	rwire_dispatcher_t  *d;
+	int                  worker;
+	bool                 timed;
+	struct timespec      until;
+	bool                 interrupted;
+	amq_content_basic_t *content;
+} rwire_dispatcher_take_t;
+
+static void * rwire_dispatcher_take_blocking(void *p)
+{
+	rwire_dispatcher_take_t * t = (rwire_dispatcher_take_t *)p;
+	rwire_dispatcher_t      * d = t->d;
+	int rc = 0;
+
+	pthread_mutex_lock(&d->lock);
+	while (!(t->content = rwire_dispatcher_next(d, t->worker)) &&
+		!d->closed && !t->interrupted && rc != ETIMEDOUT) {
+		if (t->timed)
+			rc = pthread_cond_timedwait(&d->ready, &d->lock, &t->until);
+		else
+			pthread_cond_wait(&d->ready, &d->lock);
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	return NULL;
+}
+
+static void rwire_dispatcher_take_unblock(void *p)
+{
+	rwire_dispatcher_take_t * t = (rwire_dispatcher_take_t *)p;
+
+	pthread_mutex_lock(&t->d->lock);
+	t->interrupted = true;
+	pthread_cond_broadcast(&t->d->ready);
+	pthread_mutex_unlock(&t->d->lock);
+}
+
+// Take the next content for a worker, waiting up to timeout msecs or until an
+// RWire::Deadline (forever if 0 or nil).  Returns nil on timeout, or once the
+// dispatcher is closed and drained.
+static VALUE rwire_dispatcher_take(VALUE self, VALUE worker, VALUE timeout)
+{
+	rwire_dispatcher_take_t t;
+	VALUE   rb_content = Qnil;
+	int64_t at = 0;
+
+	DISPATCHER_GET;
+	memset(&t, 0, sizeof(t));
+	t.d      = d;
+	t.worker = NUM2INT(worker);
+	t.timed  = rwire_timeout_get(timeout, &at);
+	if (t.worker < 0 || t.worker >= d->workers)
+		rb_raise(rb_eArgError, "No such worker: %d", t.worker);
+	if (d->handler)
+		rb_raise(eAMQError, "Dispatcher has native workers; use collect");
+	if (t.timed)
+		rwire_abstime(&t.until, at);
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+	rb_thread_call_without_gvl(rwire_dispatcher_take_blocking, &t,
+		rwire_dispatcher_take_unblock, &t);
+#else
+	// Without a way to release the interpreter lock, blocking here would stop
+	// the thread feeding us, so poll instead.
+	for (;;) {
+		pthread_mutex_lock(&d->lock);
+		t.content = rwire_dispatcher_next(d, t.worker);
+		pthread_mutex_unlock(&d->lock);
+		if (t.content || d->closed)
+			break;
+		if (t.timed && rwire_deadline_left(at) == 0)
+			break;
+		rb_thread_wait_for(rb_time_interval(rb_float_new(0.001)));
+	}
+#endif
+
+	if (t.content)
+		rb_content = Data_Wrap_Struct(cContent, 0, rwire_amq_content_basic_free, t.content);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+	rb_thread_check_ints();
+#endif
+
+	return rb_content;
+}
+
+// Wake every waiting worker.  Contents already queued can still be taken.
+static VALUE rwire_dispatcher_close(VALUE self)
+{
+	DISPATCHER_GET;
+
+	pthread_mutex_lock(&d->lock);
+	d->closed = true;
+	pthread_cond_broadcast(&d->ready);
+	pthread_mutex_unlock(&d->lock);
+
+	return self;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Native workers
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#define RWIRE_HAVE_ZLIB 1
+#endif
+
+// Longest inflated body, so that a bad or hostile message can't take all
+// the memory there is
+#define RWIRE_INFLATE_MAX (256 * 1024 * 1024)
+
+static const char * rwire_handler_names[] = { NULL, "hash", "crc32", "inflate" };
+
+// The handler for a Symbol, or RWIRE_HANDLER_NONE if this build lacks it
+static rwire_handler_t rwire_handler_find(VALUE name)
+{
+	ID  id = SYM2ID(name);
+	int i;
+
+	for (i = RWIRE_HANDLER_HASH; i <= RWIRE_HANDLER_INFLATE; i++) {
+		if (id == rb_intern(rwire_handler_names[i]))
+			break;
+	}
+#ifndef RWIRE_HAVE_ZLIB
+	if (i == RWIRE_HANDLER_CRC32 || i == RWIRE_HANDLER_INFLATE)
+		return RWIRE_HANDLER_NONE;
+#endif
+	return i <= RWIRE_HANDLER_INFLATE ? (rwire_handler_t)i : RWIRE_HANDLER_NONE;
+}
+
+#ifdef RWIRE_HAVE_ZLIB
+// Inflate a zlib or gzip body (told apart by its header)
+static void rwire_handler_inflate(rwire_handler_result_t *r, char *body, size_t size)
+{
+	z_stream z;
+	size_t   cap = size * 4 + 64;
+	char   * grown;
+	int      rc;
+
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, 15 + 32) != Z_OK) {
+		r->error = "Failed to start inflating";
+		return;
+	}
+	z.next_in  = (Bytef *)body;
+	z.avail_in = size;
+	r->data    = malloc(cap);
+	do {
+		if (r->len == cap) {
+			if (cap >= RWIRE_INFLATE_MAX) {
+				r->error = "Inflated body is too large";
+				break;
+			}
+			cap  *= 2;
+			grown = realloc(r->data, cap);
+			if (!grown) {
+				r->error = "Out of memory inflating body";
+				break;
+			}
+			r->data = grown;
+		}
+		z.next_out  = (Bytef *)r->data + r->len;
+		z.avail_out = cap - r->len;
+		rc = inflate(&z, Z_NO_FLUSH);
+		r->len = cap - z.avail_out;
+		if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+			r->error = "Body isn't valid zlib or gzip data";
+			break;
+		}
+		if (rc == Z_BUF_ERROR && z.avail_out) {
+			r->error = "Body is truncated zlib or gzip data";
+			break;
+		}
+	} while (rc != Z_STREAM_END);
+	inflateEnd(&z);
+	if (r->error) {
+		free(r->data);
+		r->data = NULL;
+		r->len  = 0;
+	}
+}
+#endif
+
+// Run a handler on a content.  Called without the interpreter lock, so it
+// mustn't touch Ruby; the body is read untraced because hook events
+// recorded here would never be flushed.
+static rwire_handler_result_t * rwire_handler_run(rwire_handler_t handler,
+	amq_content_basic_t *content)
+{
+	rwire_handler_result_t * r = calloc(1, sizeof(rwire_handler_result_t));
+	size_t size = amq_content_basic_get_body_size(content);
+	char * body = malloc(size ? size : 1);
+
+	amq_content_basic_get_body(content, (byte *)body, size);
+	switch (handler) {
+	case RWIRE_HANDLER_HASH:
+		r->value = rwire_hash(body, size);
+		break;
+#ifdef RWIRE_HAVE_ZLIB
+	case RWIRE_HANDLER_CRC32:
+		r->value = crc32(crc32(0L, Z_NULL, 0), (Bytef *)body, size);
+		break;
+	case RWIRE_HANDLER_INFLATE:
+		rwire_handler_inflate(r, body, size);
+		break;
+#endif
+	default:
+		r->error = "No such handler";
+	}
+	free(body);
+
+	return r;
+}
+
+static void * rwire_dispatcher_native_work(void *p)
+{
+	rwire_native_worker_t * w = (rwire_native_worker_t *)p;
+	rwire_dispatcher_t    * d = w->d;
+	amq_content_basic_t   * content;
+	rwire_handler_result_t * result;
+
+	pthread_mutex_lock(&d->lock);
+	for (;;) {
+		while (!(content = rwire_dispatcher_next(d, w->worker)) && !d->closed)
+			pthread_cond_wait(&d->ready, &d->lock);
+		if (!content)
+			break;
+		pthread_mutex_unlock(&d->lock);
+
+		result = rwire_handler_run(d->handler, content);
+
+		pthread_mutex_lock(&d->lock);
+		rwire_fifo_push(&d->done, content)->data = result;
+		pthread_cond_broadcast(&d->collected);
+	}
+	d->running--;
+	pthread_cond_broadcast(&d->collected);
+	pthread_mutex_unlock(&d->lock);
+
+	return NULL;
+}
+
+// Wait for every native worker to finish
+static void rwire_dispatcher_join(rwire_dispatcher_t *d)
+{
+	int i;
+
+	for (i = 0; i < d->started; i++)
+		pthread_join(d->natives[i].thread, NULL);
+	free(d->natives);
+	d->natives = NULL;
+}
+
+// start(handler): run the workers as native threads, each running the
+// handler (:hash, or with zlib :crc32 and :inflate) on its contents.  Take
+// the results with collect; take can't be used once started.
+static VALUE rwire_dispatcher_start(VALUE self, VALUE handler)
+{
+	int i;
+
+	DISPATCHER_GET;
+	if (d->handler)
+		rb_raise(eAMQError, "Dispatcher workers have already been started");
+	Check_Type(handler, T_SYMBOL);
+	d->handler = rwire_handler_find(handler);
+	if (!d->handler)
+		rb_raise(rb_eArgError, "Unknown handler %s", rb_id2name(SYM2ID(handler)));
+
+	d->natives = calloc(d->workers, sizeof(rwire_native_worker_t));
+	pthread_mutex_lock(&d->lock);
+	for (i = 0; i < d->workers; i++) {
+		d->natives[i].d      = d;
+		d->natives[i].worker = i;
+		if (pthread_create(&d->natives[i].thread, NULL,
+			rwire_dispatcher_native_work, &d->natives[i]) != 0)
+			break;
+		d->started++;
+		d->running++;
+	}
+	if (i < d->workers) {
+		// Stop the ones that did start, and give up
+		d->closed = true;
+		pthread_cond_broadcast(&d->ready);
+		pthread_mutex_unlock(&d->lock);
+		rwire_dispatcher_join(d);
+		rb_raise(eAMQError, "Failed to start dispatcher worker %d", i);
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	return self;
 }
 
-static VALUE rwire_amq_client_session_declare_exchange(
-	VALUE self,
-	VALUE exchange,
-	VALUE type,
-	VALUE passive,
-	VALUE durable,
-	VALUE undeletable,
-	VALUE internal)
+// RWire::Dispatcher.handlers: the handlers this build has
+static VALUE rwire_dispatcher_get_handlers(VALUE klass)
 {
-    char *_exchange = StringValuePtr(exchange);
-    char *_type = StringValuePtr(type);
-    amq_client_session_t *session = NULL;
-    Data_Get_Struct(self, amq_client_session_t, session);
-    amq_client_session_exchange_declare(session, 0,_exchange, _type, passive, durable, undeletable, internal, NULL);
-    //TODO check for a more useful value to return
-    return self;
+	VALUE handlers = rb_ary_new();
+	int   i;
+
+	for (i = RWIRE_HANDLER_HASH; i <= RWIRE_HANDLER_INFLATE; i++) {
+		if (rwire_handler_find(ID2SYM(rb_intern(rwire_handler_names[i]))))
+			rb_ary_push(handlers, ID2SYM(rb_intern(rwire_handler_names[i])));
+	}
+	return handlers;
 }
 
-static VALUE rwire_amq_client_session_declare_queue(VALUE self,
-	VALUE queuename,
-	VALUE passive,
-	VALUE durable,
-	VALUE exclusive,
-	VALUE autodelete)
+typedef struct {
+	rwire_dispatcher_t  *d;
+	bool                 timed;
+	struct timespec      until;
+	bool                 interrupted;
+	rwire_fifo_node_t   *node;
+} rwire_dispatcher_collect_t;
+
+static void * rwire_dispatcher_collect_blocking(void *p)
 {
+	rwire_dispatcher_collect_t * c = (rwire_dispatcher_collect_t *)p;
+	rwire_dispatcher_t         * d = c->d;
+	int rc = 0;
 
-	char *_queuename              = NULL;
-	amq_client_session_t *session = NULL;
+	pthread_mutex_lock(&d->lock);
+	while (!(c->node = rwire_fifo_detach(&d->done)) &&
+		d->running && !c->interrupted && rc != ETIMEDOUT) {
+		if (c->timed)
+			rc = pthread_cond_timedwait(&d->collected, &d->lock, &c->until);
+		else
+			pthread_cond_wait(&d->collected, &d->lock);
+	}
+	pthread_mutex_unlock(&d->lock);
 
-	if (queuename != Qnil)
-		_queuename = StringValuePtr(queuename);
+	return NULL;
+}
 
-	bool _passive    = (passive != Qfalse);
-	bool _durable    = (durable != Qfalse);
-	bool _exclusive  = (exclusive != Qfalse);
-	bool _autodelete = (autodelete != Qfalse);
+static void rwire_dispatcher_collect_unblock(void *p)
+{
+	rwire_dispatcher_collect_t * c = (rwire_dispatcher_collect_t *)p;
+
+	pthread_mutex_lock(&c->d->lock);
+	c->interrupted = true;
+	pthread_cond_broadcast(&c->d->collected);
+	pthread_mutex_unlock(&c->d->lock);
+}
+
+// The result of a handler as a Ruby object: an Integer for :hash and
+// :crc32, a binary String for :inflate, and an AMQDecodeError if it failed
+static VALUE rwire_handler_result_value(rwire_handler_t handler, rwire_handler_result_t *r)
+{
+	if (r->error)
+		return rb_exc_new2(eAMQDecodeError, r->error);
+	if (handler == RWIRE_HANDLER_INFLATE)
+		return rb_str_new(r->data, r->len);
+	return ULL2NUM(r->value);
+}
+
+// collect(timeout): the next [content, result] handled by the native
+// workers, waiting up to timeout msecs or until an RWire::Deadline (forever
+// if 0 or nil).  Returns nil on timeout, or once the dispatcher is closed
+// and every worker has finished.
+static VALUE rwire_dispatcher_collect(VALUE self, VALUE timeout)
+{
+	rwire_dispatcher_collect_t c;
+	rwire_handler_result_t * r;
+	VALUE   rb_content, pair = Qnil;
+	int64_t at = 0;
+
+	DISPATCHER_GET;
+	if (!d->handler)
+		rb_raise(eAMQError, "Dispatcher workers haven't been started");
+	memset(&c, 0, sizeof(c));
+	c.d     = d;
+	c.timed = rwire_timeout_get(timeout, &at);
+	if (c.timed)
+		rwire_abstime(&c.until, at);
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+	rb_thread_call_without_gvl(rwire_dispatcher_collect_blocking, &c,
+		rwire_dispatcher_collect_unblock, &c);
+#else
+	for (;;) {
+		pthread_mutex_lock(&d->lock);
+		c.node = rwire_fifo_detach(&d->done);
+		pthread_mutex_unlock(&d->lock);
+		if (c.node || !d->running)
+			break;
+		if (c.timed && rwire_deadline_left(at) == 0)
+			break;
+		rb_thread_wait_for(rb_time_interval(rb_float_new(0.001)));
+	}
+#endif
+
+	if (c.node) {
+		r = c.node->data;
+		rb_content = Data_Wrap_Struct(cContent, 0, rwire_amq_content_basic_free,
+			c.node->content);
+		free(c.node);
+		pair = rb_ary_new3(2, rb_content, rwire_handler_result_value(d->handler, r));
+		rwire_handler_result_free(r);
+	}
+	else if (d->natives && !d->running) {
+		rwire_dispatcher_join(d);
+	}
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+	rb_thread_check_ints();
+#endif
+
+	return pair;
+}
+
+static VALUE rwire_dispatcher_get_size(VALUE self)
+{
+	long size = 0;
+	int  i;
+
+	DISPATCHER_GET;
+	pthread_mutex_lock(&d->lock);
+	for (i = 0; i < d->workers; i++)
+		size += d->queues[i].size;
+	pthread_mutex_unlock(&d->lock);
+
+	return LONG2NUM(size);
+}
+
+static VALUE rwire_dispatcher_get_workers(VALUE self)
+{
+	DISPATCHER_GET;
+	return INT2FIX(d->workers);
+}
+
+static VALUE rwire_dispatcher_get_dispatched(VALUE self)
+{
+	DISPATCHER_GET;
+	return LONG2NUM(d->dispatched);
+}
+
+static VALUE rwire_dispatcher_get_stolen(VALUE self)
+{
+	DISPATCHER_GET;
+	return LONG2NUM(d->stolen);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// Functions for RWire::Conflator
+//
+/////////////////////////////////////////////////////////////////////////////
+
+// Buffers the contents arriving on a session and keeps only the latest one
+// per key.  A newer content takes the place of the one it supersedes, so keys
+// are handed out in the order they first arrived.  Superseded contents are
+// unlinked (and acknowledged, if asked to) without ever becoming Ruby
+// objects.  Contents without the key are never conflated.
+
+typedef struct rwire_conflation_entry_s {
+	uint64_t                         hash;
+	rwire_fifo_node_t               *node;
+	struct rwire_conflation_entry_s *next;
+	int                              len;
+	char                             key[1];
+} rwire_conflation_entry_t;
+
+typedef struct {
+	VALUE                      session;
+	rwire_key_t                key;
+	bool                       ack;
+	rwire_fifo_t               pending;
+	rwire_conflation_entry_t **buckets;
+	size_t                     bucket_count;    // Always a power of two
+	size_t                     entry_count;
+	long                       superseded;
+} rwire_conflator_t;
+
+#define CONFLATOR_GET \
+	rwire_conflator_t * cf = NULL;\
+	Data_Get_Struct(self, rwire_conflator_t, cf);\
+	if (!cf->buckets)\
+		rb_raise(eAMQError, "Conflator is not initialized")
+
+static void rwire_conflator_mark(void *p)
+{
+	rwire_conflator_t * cf = (rwire_conflator_t *)p;
+	rb_gc_mark(cf->session);
+}
+
+static void rwire_conflator_free(void *p)
+{
+	rwire_conflator_t        * cf = (rwire_conflator_t *)p;
+	rwire_conflation_entry_t * entry, * next;
+	size_t i;
+
+	rwire_fifo_clear(&cf->pending);
+	for (i = 0; i < cf->bucket_count; i++) {
+		for (entry = cf->buckets[i]; entry; entry = next) {
+			next = entry->next;
+			free(entry);
+		}
+	}
+	free(cf->buckets);
+	free(cf);
+}
+
+static VALUE rwire_conflator_alloc(VALUE klass)
+{
+	rwire_conflator_t * cf = calloc(1, sizeof(rwire_conflator_t));
+	cf->session = Qnil;
+	return Data_Wrap_Struct(klass, rwire_conflator_mark, rwire_conflator_free, cf);
+}
+
+static VALUE rwire_conflator_init(VALUE self, VALUE r_session, VALUE key, VALUE ack)
+{
+	rwire_conflator_t    * cf      = NULL;
+	amq_client_session_t * session = NULL;
+
+	Data_Get_Struct(self, rwire_conflator_t, cf);
+	if (cf->buckets)
+		rb_raise(eAMQError, "Conflator is already initialized");
+	SESSION_ARG_GET_STRUCT(r_session, session);
+
+	rwire_key_parse(&cf->key, key);
+	if (cf->key.type == RWIRE_KEY_NONE)
+		rb_raise(rb_eArgError, "Conflator needs a key");
+
+	cf->session      = r_session;
+	cf->ack          = TO_BOOL(ack);
+	cf->bucket_count = 64;
+	cf->buckets      = calloc(cf->bucket_count, sizeof(rwire_conflation_entry_t *));
 
-	Data_Get_Struct(self, amq_client_session_t, session);
-	amq_client_session_queue_declare(session, 0,_queuename, _passive, _durable, _exclusive, _autodelete, NULL);
-//TODO check for a more useful value to return
 	return self;
 }
 
-static VALUE rwire_amq_client_session_delete_queue(VALUE self,
-	VALUE queuename,
-	VALUE if_unused,
-	VALUE if_empty)
+static void rwire_conflator_grow(rwire_conflator_t *cf)
 {
+	size_t count = cf->bucket_count * 2;
+	rwire_conflation_entry_t ** buckets = calloc(count, sizeof(rwire_conflation_entry_t *));
+	rwire_conflation_entry_t  * entry, * next;
+	size_t i;
+
+	for (i = 0; i < cf->bucket_count; i++) {
+		for (entry = cf->buckets[i]; entry; entry = next) {
+			next = entry->next;
+			entry->next = buckets[entry->hash & (count - 1)];
+			buckets[entry->hash & (count - 1)] = entry;
+		}
+	}
+	free(cf->buckets);
+	cf->buckets      = buckets;
+	cf->bucket_count = count;
+}
 
-	char *_queuename              = NULL;
-	amq_client_session_t *session = NULL;
+// Returns false if acknowledging a superseded content failed
+static bool rwire_conflator_add(rwire_conflator_t *cf,
+	amq_client_session_t *session, amq_content_basic_t *content)
+{
+	rwire_conflation_entry_t * entry = NULL;
+	amq_content_basic_t      * old   = NULL;
+	char     key[RWIRE_KEY_MAX];
+	int      len = rwire_key_extract(&cf->key, content, key);
+	uint64_t hash;
+	bool     acked = true;
+
+	if (len < 0) {
+		rwire_fifo_push(&cf->pending, content);
+		return true;
+	}
 
-	if (queuename != Qnil)
-		_queuename = StringValuePtr(queuename);
+	hash = rwire_hash(key, len);
+	for (entry = cf->buckets[hash & (cf->bucket_count - 1)]; entry; entry = entry->next) {
+		if (entry->hash == hash && entry->len == len && memcmp(entry->key, key, len) == 0)
+			break;
+	}
 
-	bool _if_unused = (if_unused != Qfalse);
-	bool _if_empty  = (if_empty != Qfalse);
+	if (entry) {
+		old = entry->node->content;
+		entry->node->content = content;
+		if (cf->ack)
+			acked = amq_client_session_basic_ack(session,
+				amq_content_basic_get_delivery_tag(old), FALSE) == 0;
+		amq_content_basic_unlink(&old);
+		cf->superseded++;
+		return acked;
+	}
+
+	entry = malloc(sizeof(rwire_conflation_entry_t) + len);
+	entry->hash = hash;
+	entry->len  = len;
+	memcpy(entry->key, key, len);
+	entry->node = rwire_fifo_push(&cf->pending, content);
+	entry->node->data = entry;
+	entry->next = cf->buckets[hash & (cf->bucket_count - 1)];
+	cf->buckets[hash & (cf->bucket_count - 1)] = entry;
+
+	if (++cf->entry_count > cf->bucket_count)
+		rwire_conflator_grow(cf);
+	return true;
+}
+
+static amq_content_basic_t * rwire_conflator_shift(rwire_conflator_t *cf)
+{
+	rwire_conflation_entry_t  * entry = NULL;
+	rwire_conflation_entry_t ** link  = NULL;
+
+	if (!cf->pending.head)
+		return NULL;
+
+	entry = (rwire_conflation_entry_t *)cf->pending.head->data;
+	if (entry) {
+		link = &cf->buckets[entry->hash & (cf->bucket_count - 1)];
+		while (*link != entry)
+			link = &(*link)->next;
+		*link = entry->next;
+		cf->entry_count--;
+		free(entry);
+	}
+	return rwire_fifo_shift(&cf->pending);
+}
+
+static long rwire_conflator_fill(rwire_conflator_t *cf)
+{
+	amq_client_session_t * session = NULL;
+	amq_content_basic_t  * content = NULL;
+	rwire_capture_t      * cap     = rwire_session_capture(cf->session);
+	long count = 0, failed = 0;
+
+	SESSION_GET_STRUCT(cf->session, session);
+	while ((content = rwire_session_arrived(cf->session, session, cap, NULL)) != NULL) {
+		if (!rwire_conflator_add(cf, session, content))
+			failed++;
+		count++;
+	}
+
+	// Every content is ours by now, so raising loses nothing
+	if (failed)
+		rb_raise(eAMQError, "Failed to acknowledge %ld superseded contents", failed);
+	RWIRE_HOOKS_FLUSH();
+	return count;
+}
+
+// Take in everything that has arrived on the session.  Returns the number of
+// contents taken.
+static VALUE rwire_conflator_pull(VALUE self)
+{
+	CONFLATOR_GET;
+	return LONG2NUM(rwire_conflator_fill(cf));
+}
+
+// Like Session#basic_arrived: the next (latest for its key) content, or nil
+static VALUE rwire_conflator_get_basic_arrived(VALUE self)
+{
+	amq_content_basic_t * content = NULL;
+
+	CONFLATOR_GET;
+	rwire_conflator_fill(cf);
+
+	content = rwire_conflator_shift(cf);
+	if (content)
+		return Data_Wrap_Struct(cContent, 0, rwire_amq_content_basic_free, content);
+	else
+		return Qnil;
+}
+
+static VALUE rwire_conflator_get_basic_arrived_count(VALUE self)
+{
+	CONFLATOR_GET;
+	rwire_conflator_fill(cf);
+	return LONG2NUM(cf->pending.size);
+}
+
+static VALUE rwire_conflator_get_superseded(VALUE self)
+{
+	CONFLATOR_GET;
+	return LONG2NUM(cf->superseded);
+}
+
+// Hand every content still buffered back to the session, unacknowledged,
+// for a consumer that stops before taking them all.  Only superseded
+// contents are ever acknowledged: the latest for a key comes out of the
+// session's next basic_arrived, or is redelivered by the broker if nobody
+// takes it.  Returns the number of contents handed back.
+static VALUE rwire_conflator_release(VALUE self)
+{
+	amq_content_basic_t * content = NULL;
+	long count = 0;
+
+	CONFLATOR_GET;
+	while ((content = rwire_conflator_shift(cf)) != NULL) {
+		rwire_session_hand_back(cf->session, content);
+		count++;
+	}
+	return LONG2NUM(count);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// Functions for RWire::Deduplicator
+//
+/////////////////////////////////////////////////////////////////////////////
+
+// Drops contents whose key (message_id by default) has been seen before.
+// Keys are remembered as 64-bit fingerprints in a ring of fixed capacity,
+// indexed by an open addressing table twice its size.  When the ring is full
+// the oldest key is forgotten, and with a time window keys are also forgotten
+// once they are older than the window.  Memory use is fixed and every check
+// is O(1).  Duplicates are unlinked (and acknowledged, if asked to) before
+// any Ruby object is made for them.
+
+#define RWIRE_DEDUP_EMPTY 0xFFFFFFFF
+
+typedef struct {
+	uint64_t fingerprint;
+	int64_t  seen_at;           // Monotonic nsecs
+} rwire_dedup_slot_t;
+
+typedef struct {
+	VALUE               session;
+	rwire_key_t         key;
+	bool                ack;
+	int64_t             window;     // Nsecs, 0 to only forget when full
+	rwire_dedup_slot_t *slots;      // Ring in the order keys were first seen
+	uint32_t            capacity;
+	uint32_t            head;
+	uint32_t            count;
+	uint32_t           *index;      // Slot numbers, linear probing
+	uint32_t            index_mask;
+	rwire_fifo_t        pending;
+	long                duplicates;
+} rwire_dedup_t;
+
+#define DEDUP_GET \
+	rwire_dedup_t * dd = NULL;\
+	Data_Get_Struct(self, rwire_dedup_t, dd);\
+	if (!dd->slots)\
+		rb_raise(eAMQError, "Deduplicator is not initialized")
+
+static void rwire_dedup_mark(void *p)
+{
+	rwire_dedup_t * dd = (rwire_dedup_t *)p;
+	rb_gc_mark(dd->session);
+}
+
+static void rwire_dedup_free(void *p)
+{
+	rwire_dedup_t * dd = (rwire_dedup_t *)p;
+
+	rwire_fifo_clear(&dd->pending);
+	free(dd->slots);
+	free(dd->index);
+	free(dd);
+}
+
+static VALUE rwire_dedup_alloc(VALUE klass)
+{
+	rwire_dedup_t * dd = calloc(1, sizeof(rwire_dedup_t));
+	dd->session = Qnil;
+	return Data_Wrap_Struct(klass, rwire_dedup_mark, rwire_dedup_free, dd);
+}
+
+// initialize(capacity, window, key, ack): remember up to capacity keys, for
+// at most window msecs (nil for no limit)
+static VALUE rwire_dedup_init(VALUE self, VALUE capacity, VALUE window, VALUE key, VALUE ack)
+{
+	rwire_dedup_t * dd = NULL;
+	long     _capacity = NUM2LONG(capacity);
+	uint32_t size      = 1;
+
+	Data_Get_Struct(self, rwire_dedup_t, dd);
+	if (dd->slots)
+		rb_raise(eAMQError, "Deduplicator is already initialized");
+	if (_capacity < 1 || _capacity > 0x40000000)
+		rb_raise(rb_eArgError, "Deduplicator capacity out of range");
+
+	rwire_key_parse(&dd->key, key);
+	if (dd->key.type == RWIRE_KEY_NONE)
+		rb_raise(rb_eArgError, "Deduplicator needs a key");
+
+	while (size < _capacity * 2)
+		size <<= 1;
+
+	dd->ack        = TO_BOOL(ack);
+	dd->window     = NIL_P(window) ? 0 : NUM2LL(window) * 1000000;
+	dd->capacity   = _capacity;
+	dd->slots      = calloc(_capacity, sizeof(rwire_dedup_slot_t));
+	dd->index      = malloc(size * sizeof(uint32_t));
+	dd->index_mask = size - 1;
+	memset(dd->index, 0xFF, size * sizeof(uint32_t));
 
-	Data_Get_Struct(self, amq_client_session_t, session);
-	amq_client_session_queue_delete(
-		session,
-		0,
-		_queuename,
-		_if_unused,
-		_if_empty);
-//TODO check for a more useful value to return
 	return self;
 }
 
-static VALUE rwire_amq_client_session_bind_queue(VALUE self,
-	VALUE queuename,
-	VALUE exchange,
-	VALUE routing_key)
+// Position in the index of fingerprint, or of the free entry where it belongs
+static uint32_t rwire_dedup_find(rwire_dedup_t *dd, uint64_t fingerprint)
 {
-    amq_client_session_t *session = NULL;
-    char *_queuename = NULL;
-    char *_exchange = StringValuePtr(exchange);
-    char *_routing_key = StringValuePtr(routing_key);
+	uint32_t pos = fingerprint & dd->index_mask;
 
-	if (queuename != Qnil)
-		_queuename = StringValuePtr(queuename);
+	while (dd->index[pos] != RWIRE_DEDUP_EMPTY &&
+		dd->slots[dd->index[pos]].fingerprint != fingerprint)
+		pos = (pos + 1) & dd->index_mask;
 
-    Data_Get_Struct(self, amq_client_session_t, session);
-    amq_client_session_queue_bind(session, 0, _queuename, _exchange, _routing_key, NULL);
-    //TODO check for a more useful value to return
-    return self;
+	return pos;
+}
+
+// Forget the oldest key
+static void rwire_dedup_evict(rwire_dedup_t *dd)
+{
+	uint32_t mask = dd->index_mask;
+	uint32_t pos  = rwire_dedup_find(dd, dd->slots[dd->head].fingerprint);
+	uint32_t next, home;
+
+	// Shift the entries after the hole back so that no probe sequence is
+	// broken by it
+	dd->index[pos] = RWIRE_DEDUP_EMPTY;
+	for (next = (pos + 1) & mask; dd->index[next] != RWIRE_DEDUP_EMPTY; next = (next + 1) & mask) {
+		home = dd->slots[dd->index[next]].fingerprint & mask;
+		if (((next - home) & mask) >= ((next - pos) & mask)) {
+			dd->index[pos]  = dd->index[next];
+			dd->index[next] = RWIRE_DEDUP_EMPTY;
+			pos = next;
+		}
+	}
+
+	dd->head = (dd->head + 1) % dd->capacity;
+	dd->count--;
+}
+
+// True if the content's key was seen before; remembers it otherwise
+static bool rwire_dedup_seen(rwire_dedup_t *dd, amq_content_basic_t *content)
+{
+	char     key[RWIRE_KEY_MAX];
+	int      len = rwire_key_extract(&dd->key, content, key);
+	int64_t  now;
+	uint64_t fingerprint;
+	uint32_t pos, slot;
+
+	if (len < 0)
+		return false;
+
+	fingerprint = rwire_hash(key, len);
+	now = rwire_monotonic_ns();
+
+	while (dd->window && dd->count && now - dd->slots[dd->head].seen_at > dd->window)
+		rwire_dedup_evict(dd);
+
+	pos = rwire_dedup_find(dd, fingerprint);
+	if (dd->index[pos] != RWIRE_DEDUP_EMPTY)
+		return true;
+
+	if (dd->count == dd->capacity) {
+		rwire_dedup_evict(dd);
+		pos = rwire_dedup_find(dd, fingerprint);
+	}
+
+	slot = (dd->head + dd->count) % dd->capacity;
+	dd->slots[slot].fingerprint = fingerprint;
+	dd->slots[slot].seen_at     = now;
+	dd->index[pos] = slot;
+	dd->count++;
+
+	return false;
+}
+
+static long rwire_dedup_fill(rwire_dedup_t *dd)
+{
+	amq_client_session_t * session = NULL;
+	amq_content_basic_t  * content = NULL;
+	rwire_capture_t      * cap     = NULL;
+	long count = 0, failed = 0;
+	bool again;
+
+	if (NIL_P(dd->session))
+		rb_raise(eAMQError, "Deduplicator has no session");
+
+	SESSION_GET_STRUCT(dd->session, session);
+	cap = rwire_session_capture(dd->session);
+
+	while ((content = rwire_session_arrived(dd->session, session, cap, &again)) != NULL) {
+		if (!again && rwire_dedup_seen(dd, content)) {
+			if (dd->ack && amq_client_session_basic_ack(session,
+				amq_content_basic_get_delivery_tag(content), FALSE) != 0)
+				failed++;
+			amq_content_basic_unlink(&content);
+			dd->duplicates++;
+		}
+		else {
+			rwire_fifo_push(&dd->pending, content);
+			count++;
+		}
+	}
+
+	// Every content is ours by now, so raising loses nothing
+	if (failed)
+		rb_raise(eAMQError, "Failed to acknowledge %ld duplicate contents", failed);
+	RWIRE_HOOKS_FLUSH();
+	return count;
+}
+
+// Read from this session from now on.  What has been seen is kept, so one
+// deduplicator can follow a consumer across sessions.
+static VALUE rwire_dedup_set_session(VALUE self, VALUE r_session)
+{
+	amq_client_session_t * session = NULL;
+
+	DEDUP_GET;
+	if (!NIL_P(r_session)) {
+		SESSION_ARG_GET_STRUCT(r_session, session);
+	}
+	dd->session = r_session;
+
+	return r_session;
+}
+
+static VALUE rwire_dedup_get_session(VALUE self)
+{
+	DEDUP_GET;
+	return dd->session;
+}
+
+// Take in everything that has arrived on the session.  Returns the number of
+// contents that weren't duplicates.
+static VALUE rwire_dedup_pull(VALUE self)
+{
+	DEDUP_GET;
+	return LONG2NUM(rwire_dedup_fill(dd));
+}
+
+// Like Session#basic_arrived, skipping duplicates
+static VALUE rwire_dedup_get_basic_arrived(VALUE self)
+{
+	amq_content_basic_t * content = NULL;
+
+	DEDUP_GET;
+	rwire_dedup_fill(dd);
+
+	content = rwire_fifo_shift(&dd->pending);
+	if (content)
+		return Data_Wrap_Struct(cContent, 0, rwire_amq_content_basic_free, content);
+	else
+		return Qnil;
+}
+
+static VALUE rwire_dedup_get_basic_arrived_count(VALUE self)
+{
+	DEDUP_GET;
+	rwire_dedup_fill(dd);
+	return LONG2NUM(dd->pending.size);
+}
+
+// Hand every content not yet taken back to the session, as
+// Conflator#release does.  What has been seen is kept.  Returns the number
+// of contents handed back.
+static VALUE rwire_dedup_release(VALUE self)
+{
+	amq_content_basic_t * content = NULL;
+	long count = 0;
+
+	DEDUP_GET;
+	if (NIL_P(dd->session))
+		return INT2FIX(0);
+	while ((content = rwire_fifo_shift(&dd->pending)) != NULL) {
+		rwire_session_hand_back(dd->session, content);
+		count++;
+	}
+	return LONG2NUM(count);
+}
+
+static VALUE rwire_dedup_get_duplicates(VALUE self)
+{
+	DEDUP_GET;
+	return LONG2NUM(dd->duplicates);
+}
+
+// Number of keys currently remembered
+static VALUE rwire_dedup_get_size(VALUE self)
+{
+	DEDUP_GET;
+	return ULONG2NUM(dd->count);
+}
+
+static VALUE rwire_dedup_get_capacity(VALUE self)
+{
+	DEDUP_GET;
+	return ULONG2NUM(dd->capacity);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// Functions for RWire::Prioritizer
+//
+/////////////////////////////////////////////////////////////////////////////
+
+// Buffers the contents arriving on a session in one FIFO per priority level
+// and hands out the highest level first.  The level is the priority property
+// or a numeric header, clamped to 0..levels-1.  To keep lower levels from
+// starving, after fairness contents in a row were taken while lower levels
+// waited, the content that has waited longest goes next instead.
+
+#define RWIRE_PRIORITY_MAX_LEVELS 64
+
+typedef struct {
+	VALUE         session;
+	rwire_key_t   key;          // Header carrying the level, none for priority
+	int           levels;
+	int           fairness;     // 0 for strict priority
+	int           passed;       // Picks in a row that passed lower levels over
+	uint64_t      waiting;      // Bit per non-empty level
+	uintptr_t     arrivals;     // Arrival number of the next content
+	rwire_fifo_t *queues;
+	long          size;
+	long          aged;         // Contents taken early to stop starvation
+} rwire_prioritizer_t;
+
+#define PRIORITIZER_GET \
+	rwire_prioritizer_t * pr = NULL;\
+	Data_Get_Struct(self, rwire_prioritizer_t, pr);\
+	if (!pr->queues)\
+		rb_raise(eAMQError, "Prioritizer is not initialized")
+
+static void rwire_prioritizer_mark(void *p)
+{
+	rwire_prioritizer_t * pr = (rwire_prioritizer_t *)p;
+	rb_gc_mark(pr->session);
 }
 
-static VALUE rwire_amq_client_session_consume(VALUE self,
-	VALUE queuename,
-	VALUE consumer_tag,
-	VALUE no_local,
-	VALUE no_ack,
-	VALUE exclusive)
+static void rwire_prioritizer_free(void *p)
 {
-	int result;
-	amq_client_session_t *session = NULL;
-	char *_queuename              = NULL;
-	char *_consumer_tag           = NULL;
-	bool _no_local   = (no_local != Qfalse);
-	bool _no_ack     = (no_ack != Qfalse);
-	bool _exclusive  = (exclusive != Qfalse);
+	rwire_prioritizer_t * pr = (rwire_prioritizer_t *)p;
+	int i;
 
-	if (queuename != Qnil)
-		_queuename = StringValuePtr(queuename);
+	for (i = 0; pr->queues && i < pr->levels; i++)
+		rwire_fifo_clear(&pr->queues[i]);
+	free(pr->queues);
+	free(pr);
+}
 
-	if (consumer_tag != Qnil)
-		_consumer_tag = StringValuePtr(consumer_tag);
+static VALUE rwire_prioritizer_alloc(VALUE klass)
+{
+	rwire_prioritizer_t * pr = calloc(1, sizeof(rwire_prioritizer_t));
+	pr->session = Qnil;
+	return Data_Wrap_Struct(klass, rwire_prioritizer_mark, rwire_prioritizer_free, pr);
+}
 
+// initialize(session, levels, header, fairness): header is nil to use the
+// priority property
+static VALUE rwire_prioritizer_init(VALUE self, VALUE r_session, VALUE levels,
+	VALUE header, VALUE fairness)
+{
+	rwire_prioritizer_t  * pr      = NULL;
+	amq_client_session_t * session = NULL;
+	int _levels = NUM2INT(levels);
+
+	Data_Get_Struct(self, rwire_prioritizer_t, pr);
+	if (pr->queues)
+		rb_raise(eAMQError, "Prioritizer is already initialized");
+	SESSION_ARG_GET_STRUCT(r_session, session);
+	if (_levels < 1 || _levels > RWIRE_PRIORITY_MAX_LEVELS)
+		rb_raise(rb_eArgError, "Prioritizer levels must be from 1 to %d",
+			RWIRE_PRIORITY_MAX_LEVELS);
+	if (!NIL_P(header) && TYPE(header) != T_STRING)
+		rb_raise(rb_eTypeError, "Priority header must be a String");
+	rwire_key_parse(&pr->key, header);
+
+	pr->session  = r_session;
+	pr->levels   = _levels;
+	pr->fairness = NIL_P(fairness) ? 0 : NUM2INT(fairness);
+	pr->queues   = calloc(_levels, sizeof(rwire_fifo_t));
 
-	Data_Get_Struct(self, amq_client_session_t, session);
-	result = amq_client_session_basic_consume(session, 0, _queuename, _consumer_tag, _no_local, _no_ack, _exclusive, NULL);
-//TODO check for a more useful value to return
 	return self;
 }
 
-static VALUE rwire_amq_client_session_basic_cancel(VALUE self,
-	VALUE consumer_tag)
+static int rwire_prioritizer_level(rwire_prioritizer_t *pr, amq_content_basic_t *content)
 {
-	int result;
-	amq_client_session_t *session = NULL;
-	char *_consumer_tag           = NULL;
-
-	if (consumer_tag != Qnil)
-		_consumer_tag = StringValuePtr(consumer_tag);
+	char key[RWIRE_KEY_MAX];
+	long level = 0;
+
+	if (pr->key.type == RWIRE_KEY_NONE)
+		level = amq_content_basic_get_priority(content);
+	else if (rwire_key_extract(&pr->key, content, key) > 0)
+		level = strtol(key, NULL, 10);
+
+	if (level < 0)
+		return 0;
+	if (level >= pr->levels)
+		return pr->levels - 1;
+	return (int)level;
+}
 
+static void rwire_prioritizer_add(rwire_prioritizer_t *pr, amq_content_basic_t *content)
+{
+	int level = rwire_prioritizer_level(pr, content);
+	rwire_fifo_node_t * node = rwire_fifo_push(&pr->queues[level], content);
 
-	Data_Get_Struct(self, amq_client_session_t, session);
-	result = amq_client_session_basic_cancel(session, _consumer_tag);
-	fprintf(stderr, "amq_client_session_basic_cancel returns %d\n", result);
-//TODO check for a more useful value to return
-	return self;
+	node->data = (void *)pr->arrivals++;
+	pr->waiting |= (uint64_t)1 << level;
+	pr->size++;
 }
 
-
-static VALUE rwire_amq_client_session_publish_body(VALUE self,
-	VALUE body,
-	VALUE exchange,
-	VALUE routing_key,
-        VALUE r_mandatory,
-        VALUE r_immediate,
-        VALUE r_reply_to)
+static amq_content_basic_t * rwire_prioritizer_shift(rwire_prioritizer_t *pr)
 {
-	char * exch = NULL;
-	char * rkey = NULL;
-	char * reply_to = NULL;
+	amq_content_basic_t * content = NULL;
+	uint64_t  rest;
+	uintptr_t oldest;
+	int       level, low, i;
+
+	if (!pr->waiting)
+		return NULL;
+
+	level = 63 - __builtin_clzll(pr->waiting);
+	low   = __builtin_ctzll(pr->waiting);
+
+	if (level == low)
+		pr->passed = 0;
+	else if (pr->fairness && ++pr->passed > pr->fairness) {
+		// Let whatever has waited longest go first.  Arrival numbers only
+		// grow, so the oldest content is at the head of some level.
+		pr->passed = 0;
+		oldest = (uintptr_t)pr->queues[level].head->data;
+		for (rest = pr->waiting; rest; rest &= rest - 1) {
+			i = __builtin_ctzll(rest);
+			if ((uintptr_t)pr->queues[i].head->data < oldest) {
+				oldest = (uintptr_t)pr->queues[i].head->data;
+				level  = i;
+			}
+		}
+		if (level != 63 - __builtin_clzll(pr->waiting))
+			pr->aged++;
+	}
 
-	bool mandatory = TO_BOOL(r_mandatory);
-	bool immediate = TO_BOOL(r_immediate);
+	content = rwire_fifo_shift(&pr->queues[level]);
+	if (!pr->queues[level].head)
+		pr->waiting &= ~((uint64_t)1 << level);
+	pr->size--;
 
-    	amq_client_session_t * session = NULL;
-	amq_content_basic_t *  content = amq_content_basic_new();
+	return content;
+}
 
-	if (!NIL_P(exchange)) {
-		exch = StringValuePtr(exchange);
-	}
+static long rwire_prioritizer_fill(rwire_prioritizer_t *pr)
+{
+	amq_client_session_t * session = NULL;
+	amq_content_basic_t  * content = NULL;
+	rwire_capture_t      * cap     = rwire_session_capture(pr->session);
+	long count = 0;
 
-	if (!NIL_P(routing_key)) {
-		rkey = StringValuePtr(routing_key);
+	SESSION_GET_STRUCT(pr->session, session);
+	while ((content = rwire_session_arrived(pr->session, session, cap, NULL)) != NULL) {
+		rwire_prioritizer_add(pr, content);
+		count++;
 	}
+	RWIRE_HOOKS_FLUSH();
+	return count;
+}
 
-	if (!NIL_P(r_reply_to)) {
-		reply_to = StringValuePtr(r_reply_to);
-	}
+// Take in everything that has arrived on the session.  Returns the number of
+// contents taken.
+static VALUE rwire_prioritizer_pull(VALUE self)
+{
+	PRIORITIZER_GET;
+	return LONG2NUM(rwire_prioritizer_fill(pr));
+}
 
-	Data_Get_Struct(self, amq_client_session_t, session);
+// Like Session#basic_arrived: the next content by priority, or nil
+static VALUE rwire_prioritizer_get_basic_arrived(VALUE self)
+{
+	amq_content_basic_t * content = NULL;
 
-	int rc = 0;
-	char * errmsg = NULL;
+	PRIORITIZER_GET;
+	rwire_prioritizer_fill(pr);
 
-	do {
-		char * blob = new_blob_from_rb_str(body);
-		int    size = RSTRING_LEN(body);
+	content = rwire_prioritizer_shift(pr);
+	if (content)
+		return Data_Wrap_Struct(cContent, 0, rwire_amq_content_basic_free, content);
+	else
+		return Qnil;
+}
 
-		// Set the content body
-		rc = amq_content_basic_set_body(content, blob, size, free);
-		if (rc) {
-			errmsg = "Unable to set content body";
-			break;
-		}
+static VALUE rwire_prioritizer_get_basic_arrived_count(VALUE self)
+{
+	PRIORITIZER_GET;
+	rwire_prioritizer_fill(pr);
+	return LONG2NUM(pr->size);
+}
 
-		// Set the reply_to field if passed in
-		if (reply_to) {
-			rc = amq_content_basic_set_reply_to(content, reply_to);
-			if (rc) {
-				errmsg = "Unable to set reply_to field";
-				break;
-			}
+// The number of contents waiting at each level, lowest level first
+static VALUE rwire_prioritizer_get_sizes(VALUE self)
+{
+	VALUE sizes;
+	int   i;
+
+	PRIORITIZER_GET;
+	sizes = rb_ary_new2(pr->levels);
+	for (i = 0; i < pr->levels; i++)
+		rb_ary_push(sizes, LONG2NUM(pr->queues[i].size));
+	return sizes;
+}
 
-		}
+static VALUE rwire_prioritizer_get_aged(VALUE self)
+{
+	PRIORITIZER_GET;
+	return LONG2NUM(pr->aged);
+}
 
-		// Publish
-		rc = amq_client_session_basic_publish(session, content, 0, exch, rkey, mandatory, immediate);
-		if (rc) {
-			errmsg = "Failed to publish message";
-			break;
+// Hand every content not yet taken back to the session, in the order they
+// arrived, as Conflator#release does.  Returns the number of contents
+// handed back.
+static VALUE rwire_prioritizer_release(VALUE self)
+{
+	uint64_t  rest;
+	uintptr_t oldest;
+	int       level, i;
+	long      count = 0;
+
+	PRIORITIZER_GET;
+	while (pr->waiting) {
+		level  = __builtin_ctzll(pr->waiting);
+		oldest = (uintptr_t)pr->queues[level].head->data;
+		for (rest = pr->waiting; rest; rest &= rest - 1) {
+			i = __builtin_ctzll(rest);
+			if ((uintptr_t)pr->queues[i].head->data < oldest) {
+				oldest = (uintptr_t)pr->queues[i].head->data;
+				level  = i;
+			}
 		}
+		rwire_session_hand_back(pr->session, rwire_fifo_shift(&pr->queues[level]));
+		if (!pr->queues[level].head)
+			pr->waiting &= ~((uint64_t)1 << level);
+		pr->size--;
+		count++;
+	}
+	return LONG2NUM(count);
+}
 
-	} while (false);
+/////////////////////////////////////////////////////////////////////////////
+//
+// Functions for RWire::LocalQueue
+//
+/////////////////////////////////////////////////////////////////////////////
 
-	if (content) {
-		amq_content_basic_unlink(&content);
-	}
-	if (rc) {
-		rb_raise(eAMQError, errmsg);
+// A thread safe queue of contents for passing messages around inside the
+// process, used by the loopback transport.  Pushing a content only takes a
+// link on it, so the same content can sit in several queues.
+//
+// An entry can carry the exchange and routing key the content was published
+// to, which are set on the content as it's shifted.  Every queue a publish
+// reaches shares the one content, since they all see the same routing.  A
+// content that was routed differently before (published again to another
+// key, or passed on after being consumed) is copied at that point, so that
+// nobody sees its routing change under them.
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t  ready;
+	rwire_fifo_t    contents;   // Routing in node data, if pushed with one
+	bool            closed;
+} rwire_local_queue_t;
+
+typedef struct {
+	char * exchange;
+	char * routing_key;
+} rwire_local_route_t;
+
+static void rwire_local_route_free(rwire_local_route_t *route)
+{
+	if (route) {
+		free(route->exchange);
+		free(route->routing_key);
+		free(route);
 	}
-
-	//TODO check for a more useful value to return
-	return self;
 }
 
-static VALUE rwire_amq_client_session_publish_content(VALUE self,
-	VALUE r_content,
-	VALUE exchange,
-	VALUE routing_key,
-        VALUE r_mandatory,
-        VALUE r_immediate)
+static bool rwire_str_same(const char *a, const char *b)
 {
-	char * exch = NULL;
-	char * rkey = NULL;
-
-	bool mandatory = TO_BOOL(r_mandatory);
-	bool immediate = TO_BOOL(r_immediate);
-
-    	amq_client_session_t * session = NULL;
-	amq_content_basic_t  * content = amq_content_basic_new();
+	return strcmp(a ? a : "", b ? b : "") == 0;
+}
 
-	if (!NIL_P(exchange)) {
-		exch = StringValuePtr(exchange);
+// Set the routing of an entry on its content, copying the content first if
+// it was routed somewhere else.  Returns the content to hand out.
+static amq_content_basic_t * rwire_local_route_apply(amq_content_basic_t *content,
+	rwire_local_route_t *route)
+{
+	char * exchange    = amq_content_basic_get_exchange(content);
+	char * routing_key = amq_content_basic_get_routing_key(content);
+	amq_content_basic_t * copy;
+
+	if (rwire_str_same(exchange, route->exchange) &&
+		rwire_str_same(routing_key, route->routing_key))
+		return content;
+	if (!rwire_str_same(exchange, NULL) || !rwire_str_same(routing_key, NULL)) {
+		copy = rwire_content_copy(content);
+		amq_content_basic_unlink(&content);
+		content = copy;
 	}
+	amq_content_basic_set_routing_key(content, route->exchange, route->routing_key, 0);
+	return content;
+}
 
-	if (!NIL_P(routing_key)) {
-		rkey = StringValuePtr(routing_key);
+// Shift the oldest content with its routing set, handing its link to the
+// caller.  Must be called with the queue lock held.
+static amq_content_basic_t * rwire_local_queue_next(rwire_local_queue_t *q)
+{
+	rwire_fifo_node_t   * node = rwire_fifo_detach(&q->contents);
+	amq_content_basic_t * content;
+
+	if (!node)
+		return NULL;
+	content = node->content;
+	if (node->data) {
+		content = rwire_local_route_apply(content, node->data);
+		rwire_local_route_free(node->data);
 	}
+	free(node);
+	return content;
+}
 
-	Data_Get_Struct(self, amq_client_session_t, session);
-	Data_Get_Struct(r_content, amq_content_basic_t, content);
-
-	int rc = 0;
-	do {
-		rc = amq_client_session_basic_publish(session, content, 0, exch, rkey, mandatory, immediate);
-		if (rc) {
-			rb_raise(eAMQError, "Failed to publish message");
-		}
-	} while (false);
+// Must be called with the queue lock held
+static void rwire_local_queue_drop(rwire_local_queue_t *q)
+{
+	rwire_fifo_node_t * node;
 
-	return self;
+	while ((node = rwire_fifo_detach(&q->contents)) != NULL) {
+		rwire_local_route_free(node->data);
+		amq_content_basic_unlink(&node->content);
+		free(node);
+	}
 }
 
-static VALUE rwire_amq_client_session_basic_get(VALUE self, VALUE queuename)
+static void rwire_local_queue_free(void *p)
 {
-	char *_queuename              = NULL;
-	amq_client_session_t *session = NULL;
+	rwire_local_queue_t * q = (rwire_local_queue_t *)p;
 
-	if (queuename != Qnil)
-		_queuename = StringValuePtr(queuename);
+	rwire_local_queue_drop(q);
+	pthread_cond_destroy(&q->ready);
+	pthread_mutex_destroy(&q->lock);
+	free(q);
+}
 
-	Data_Get_Struct(self, amq_client_session_t, session);
+static VALUE rwire_local_queue_alloc(VALUE klass)
+{
+	rwire_local_queue_t * q = calloc(1, sizeof(rwire_local_queue_t));
+	pthread_mutex_init(&q->lock, NULL);
+	rwire_cond_init(&q->ready);
+	return Data_Wrap_Struct(klass, 0, rwire_local_queue_free, q);
+}
 
-	int rc = amq_client_session_basic_get(session,0, _queuename, 0);
+// push(content, exchange = nil, routing_key = nil): with an exchange or
+// routing key the content is shifted routed there
+static VALUE rwire_local_queue_push(int argc, VALUE *argv, VALUE self)
+{
+	rwire_local_queue_t * q       = NULL;
+	amq_content_basic_t * content = NULL;
+	rwire_local_route_t * route   = NULL;
+	VALUE r_content, exchange, routing_key;
 
-	if (rc)
-	{
-		rb_raise(eAMQError, "Failed to basic get");
+	rb_scan_args(argc, argv, "12", &r_content, &exchange, &routing_key);
+	Data_Get_Struct(self, rwire_local_queue_t, q);
+	Data_Get_Struct(r_content, amq_content_basic_t, content);
+	if (!content)
+		rb_raise(eAMQDestroyedError, "Content has already been unlinked");
+	if (!NIL_P(exchange) || !NIL_P(routing_key)) {
+		route = malloc(sizeof(rwire_local_route_t));
+		route->exchange    = strdup(NIL_P(exchange) ? "" : StringValueCStr(exchange));
+		route->routing_key = strdup(NIL_P(routing_key) ? "" : StringValueCStr(routing_key));
 	}
 
+	pthread_mutex_lock(&q->lock);
+	rwire_fifo_push(&q->contents, amq_content_basic_link(content))->data = route;
+	pthread_cond_broadcast(&q->ready);
+	pthread_mutex_unlock(&q->lock);
+
 	return self;
 }
 
-static VALUE rwire_amq_client_session_get_basic_arrived(VALUE self)
+// Push a content, taking over the caller's link
+static void rwire_local_queue_give(VALUE self, amq_content_basic_t *content)
 {
-	VALUE rb_content;
-	amq_client_session_t * session = NULL;
-	amq_content_basic_t  * content = NULL;
+	rwire_local_queue_t * q = NULL;
 
-	Data_Get_Struct(self, amq_client_session_t, session);
+	Data_Get_Struct(self, rwire_local_queue_t, q);
+	pthread_mutex_lock(&q->lock);
+	rwire_fifo_push(&q->contents, content);
+	pthread_cond_broadcast(&q->ready);
+	pthread_mutex_unlock(&q->lock);
+}
 
-	content = amq_client_session_basic_arrived(session);
+// Shift a content, handing its link to the caller
+static amq_content_basic_t * rwire_local_queue_take(VALUE self)
+{
+	rwire_local_queue_t * q       = NULL;
+	amq_content_basic_t * content = NULL;
 
-	if (content)
-	{
-		rb_content = Data_Wrap_Struct(cContent, 0, rwire_amq_content_basic_free, content);
-		return rb_content;
-	}
-	else
-		return Qnil;
+	Data_Get_Struct(self, rwire_local_queue_t, q);
+	pthread_mutex_lock(&q->lock);
+	content = rwire_local_queue_next(q);
+	pthread_mutex_unlock(&q->lock);
 
+	return content;
 }
 
-static VALUE rwire_amq_client_session_get_basic_arrived_count(VALUE self)
+static long rwire_local_queue_count(VALUE self)
 {
-	amq_client_session_t * session = NULL;
-
-	Data_Get_Struct(self, amq_client_session_t, session);
+	rwire_local_queue_t * q = NULL;
+	long count;
 
-	int rc = amq_client_session_get_basic_arrived_count(session);
+	Data_Get_Struct(self, rwire_local_queue_t, q);
+	pthread_mutex_lock(&q->lock);
+	count = q->contents.size;
+	pthread_mutex_unlock(&q->lock);
 
-	return INT2FIX(rc);
+	return count;
 }
 
-static VALUE rwire_amq_client_session_get_basic_returned(VALUE self)
+// The oldest content, or nil if the queue is empty
+static VALUE rwire_local_queue_shift(VALUE self)
 {
-	VALUE rb_content;
-	amq_client_session_t * session = NULL;
-	amq_content_basic_t  * content = NULL;
+	rwire_local_queue_t * q       = NULL;
+	amq_content_basic_t * content = NULL;
 
-	Data_Get_Struct(self, amq_client_session_t, session);
+	VALUE rb_content = Qnil;
 
-	content = amq_client_session_basic_returned(session);
+	Data_Get_Struct(self, rwire_local_queue_t, q);
 
-	if (content)
-	{
+	pthread_mutex_lock(&q->lock);
+	content = rwire_local_queue_next(q);
+	pthread_mutex_unlock(&q->lock);
+
+	if (content) {
 		rb_content = Data_Wrap_Struct(cContent, 0, rwire_amq_content_basic_free, content);
-		return rb_content;
+		RWIRE_HOOKS_FLUSH();
 	}
-	else
-		return Qnil;
+	return rb_content;
+}
+
+// Move every content over to another queue, e.g. once a queue gets a
+// consumer.  Returns the number of contents moved.
+static VALUE rwire_local_queue_move_to(VALUE self, VALUE r_other)
+{
+	rwire_local_queue_t * q     = NULL;
+	rwire_local_queue_t * other = NULL;
+	rwire_fifo_node_t   * node  = NULL;
+	long count = 0;
+
+	Data_Get_Struct(self, rwire_local_queue_t, q);
+	if (!rb_obj_is_kind_of(r_other, cLocalQueue))
+		rb_raise(rb_eTypeError, "Target was not an RWire::LocalQueue");
+	Data_Get_Struct(r_other, rwire_local_queue_t, other);
+	if (q == other)
+		return INT2FIX(0);
+
+	// Always lock in the same order so that two threads moving in opposite
+	// directions can't deadlock
+	pthread_mutex_lock(q < other ? &q->lock : &other->lock);
+	pthread_mutex_lock(q < other ? &other->lock : &q->lock);
+	while ((node = rwire_fifo_detach(&q->contents)) != NULL) {
+		rwire_fifo_append(&other->contents, node);
+		count++;
+	}
+	if (count)
+		pthread_cond_broadcast(&other->ready);
+	pthread_mutex_unlock(&q->lock);
+	pthread_mutex_unlock(&other->lock);
 
+	return LONG2NUM(count);
 }
 
-static VALUE rwire_amq_client_session_get_basic_returned_count(VALUE self)
+// Drop every content.  Returns the number dropped.
+static VALUE rwire_local_queue_clear(VALUE self)
 {
-	amq_client_session_t * session = NULL;
+	rwire_local_queue_t * q = NULL;
+	long count;
 
-	Data_Get_Struct(self, amq_client_session_t, session);
+	Data_Get_Struct(self, rwire_local_queue_t, q);
 
-	int rc = amq_client_session_get_basic_returned_count(session);
+	pthread_mutex_lock(&q->lock);
+	count = q->contents.size;
+	rwire_local_queue_drop(q);
+	pthread_mutex_unlock(&q->lock);
 
-	return INT2FIX(rc);
+	return LONG2NUM(count);
 }
 
-
-static VALUE rwire_amq_client_session_get_consumer_tag(VALUE self)
+static VALUE rwire_local_queue_get_size(VALUE self)
 {
-	amq_client_session_t * session = NULL;
+	rwire_local_queue_t * q = NULL;
+	Data_Get_Struct(self, rwire_local_queue_t, q);
+	return LONG2NUM(q->contents.size);
+}
 
-	Data_Get_Struct(self, amq_client_session_t, session);
+typedef struct {
+	rwire_local_queue_t *q;
+	bool                 timed;
+	struct timespec      until;
+	bool                 interrupted;
+} rwire_local_queue_wait_t;
 
-	char * tag = amq_client_session_get_consumer_tag(session);
+static void * rwire_local_queue_wait_blocking(void *p)
+{
+	rwire_local_queue_wait_t * w = (rwire_local_queue_wait_t *)p;
+	rwire_local_queue_t      * q = w->q;
+	int rc = 0;
 
-	return rb_str_new2(tag);
+	pthread_mutex_lock(&q->lock);
+	while (q->contents.size == 0 && !q->closed && !w->interrupted && rc != ETIMEDOUT) {
+		if (w->timed)
+			rc = pthread_cond_timedwait(&q->ready, &q->lock, &w->until);
+		else
+			pthread_cond_wait(&q->ready, &q->lock);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return NULL;
 }
 
-static VALUE rwire_amq_client_session_get_alive(VALUE self)
+static void rwire_local_queue_wait_unblock(void *p)
 {
-	amq_client_session_t * session = NULL;
+	rwire_local_queue_wait_t * w = (rwire_local_queue_wait_t *)p;
 
-	Data_Get_Struct(self, amq_client_session_t, session);
+	pthread_mutex_lock(&w->q->lock);
+	w->interrupted = true;
+	pthread_cond_broadcast(&w->q->ready);
+	pthread_mutex_unlock(&w->q->lock);
+}
 
-	bool alive = amq_client_session_get_alive(session);
+// Wait until the queue isn't empty, for up to timeout msecs or until an
+// RWire::Deadline.  0 or nil waits for as long as it takes.  Returns true if
+// there is something to shift.
+static VALUE rwire_local_queue_wait(VALUE self, VALUE timeout)
+{
+	rwire_local_queue_wait_t w;
+	int64_t at = 0;
+
+	memset(&w, 0, sizeof(w));
+	Data_Get_Struct(self, rwire_local_queue_t, w.q);
+
+	w.timed = rwire_timeout_get(timeout, &at);
+	if (w.timed)
+		rwire_abstime(&w.until, at);
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+	rb_thread_call_without_gvl(rwire_local_queue_wait_blocking, &w,
+		rwire_local_queue_wait_unblock, &w);
+	rb_thread_check_ints();
+#else
+	// Blocking here would stop the publishing threads, so poll instead
+	while (w.q->contents.size == 0 && !w.q->closed &&
+		(!w.timed || rwire_deadline_left(at) > 0)) {
+		rb_thread_wait_for(rb_time_interval(rb_float_new(0.001)));
+	}
+#endif
 
-	return (alive ? Qtrue : Qfalse);
+	return w.q->contents.size > 0 ? Qtrue : Qfalse;
 }
 
+// Wake up all waiters for good
+static VALUE rwire_local_queue_close(VALUE self)
+{
+	rwire_local_queue_t * q = NULL;
+
+	Data_Get_Struct(self, rwire_local_queue_t, q);
+
+	pthread_mutex_lock(&q->lock);
+	q->closed = true;
+	pthread_cond_broadcast(&q->ready);
+	pthread_mutex_unlock(&q->lock);
+
+	return self;
+}
 
 /////////////////////////////////////////////////////////////////////////////
 //
@@ -881,18 +5782,43 @@ static VALUE rwire_amq_client_session_get_alive(VALUE self)
 
 void Init_rwire()
 {
-	icl_system_initialise(0, NULL);
-
+	// The runtime starts with the first connection or content; see
+	// rwire_runtime_ensure
+	pthread_atfork(NULL, NULL, rwire_after_fork_child);
 
 	cRWire      = rb_define_module("RWire");
 	cConnection = rb_define_class_under(cRWire, "Connection", rb_cObject);
 	cSession    = rb_define_class_under(cRWire, "Session",    rb_cObject);
 	cContent    = rb_define_class_under(cRWire, "Content",    rb_cObject);
+	cDispatcher = rb_define_class_under(cRWire, "Dispatcher", rb_cObject);
+	cPublisher  = rb_define_class_under(cRWire, "Publisher",  rb_cObject);
+	cCapture    = rb_define_class_under(cRWire, "Capture",    rb_cObject);
+	cCaptureReader = rb_define_class_under(cRWire, "CaptureReader", rb_cObject);
+	cConflator  = rb_define_class_under(cRWire, "Conflator",  rb_cObject);
+	cDeduplicator = rb_define_class_under(cRWire, "Deduplicator", rb_cObject);
+	cRateLimiter  = rb_define_class_under(cRWire, "RateLimiter",  rb_cObject);
+	cDeadline     = rb_define_class_under(cRWire, "Deadline",     rb_cObject);
+	cLocalQueue   = rb_define_class_under(cRWire, "LocalQueue",   rb_cObject);
+	cPrioritizer  = rb_define_class_under(cRWire, "Prioritizer",  rb_cObject);
 	eAMQError   = rb_define_class("AMQError", rb_eRuntimeError);
 	eAMQDestroyedError = rb_define_class("AMQDestroyedError", eAMQError);
+	eAMQRateLimitError = rb_define_class("AMQRateLimitError", eAMQError);
+	eAMQDecodeError    = rb_define_class("AMQDecodeError", eAMQError);
+
+	id_capture      = rb_intern("@capture");
+	id_held         = rb_intern("@held");
+	id_rate_limiter = rb_intern("@rate_limiter");
 
 	// RWire
 	rb_define_method(cRWire, "initialize", rwire_init, 1); //initialize(trace_levoel)
+	rb_define_module_function(cRWire, "monotonic_time", rwire_monotonic_time, 0);
+	rb_define_module_function(cRWire, "hook", rwire_hook, -1); // event, every
+	rb_define_module_function(cRWire, "unhook", rwire_unhook, -1); // event
+	rb_define_module_function(cRWire, "hooks", rwire_get_hooks, 0);
+	rb_define_module_function(cRWire, "events", rwire_get_events, 0);
+	rwire_hooks = rb_ary_new();
+	rb_gc_register_address(&rwire_hooks);
+	pthread_key_create(&rwire_trace_key, rwire_trace_state_free);
 
 	// Content
 	rb_define_alloc_func(cContent, rwire_amq_content_basic_alloc);
@@ -906,9 +5832,12 @@ void Init_rwire()
 	RB_DEF_CONTENT_GETTER(exchange);
 	RB_DEF_CONTENT_GETTER(routing_key);
 
-	// TODO: Set routing key requires multiple arguments
-	// Not terribly useful since routing key is usually set when sending message
-	//rb_define_method(cContent, "routing_key=", rwire_amq_content_basic_set_routing_key, 1);
+	// Setting the routing key takes the exchange as well.  Usually the broker
+	// sets it, so it isn't a plain attribute.
+	rb_define_method(cContent, "set_routing_key", rwire_amq_content_basic_set_routing_key, 2);
+	rb_define_method(cContent, "copy", rwire_amq_content_basic_copy, 0);
+	rb_define_method(cContent, "encode_body", rwire_amq_content_basic_encode_body, 2); // object, format
+	rb_define_method(cContent, "decode_body", rwire_amq_content_basic_decode_body, -1); // format, symbolize_keys
 
 	RB_DEF_CONTENT_ATTR(content_type);
 	RB_DEF_CONTENT_ATTR(content_encoding);
@@ -918,6 +5847,7 @@ void Init_rwire()
 	RB_DEF_CONTENT_ATTR(app_id);
 
 	RB_DEF_CONTENT_GETTER(body_size);
+	RB_DEF_CONTENT_GETTER(delivery_tag);
 	RB_DEF_CONTENT_GETTER(class_id);
 	RB_DEF_CONTENT_ATTR(priority);
 	RB_DEF_CONTENT_ATTR(delivery_mode);
@@ -963,13 +5893,16 @@ void Init_rwire()
 // Session
 	RB_DEF_SESS_METHOD(destroy, 0);
 	RB_DEF_SESS_METHOD(wait, 1); // timeout
+	RB_DEF_SESS_METHOD(wait_active, 1); // timeout
 	RB_DEF_SESS_GETTER(basic_arrived);
 	RB_DEF_SESS_GETTER(basic_arrived_count);
 	RB_DEF_SESS_GETTER(basic_returned);
 	RB_DEF_SESS_GETTER(basic_returned_count);
 	RB_DEF_SESS_BOOL_GETTER(alive);
+	RB_DEF_SESS_ATTR(capture);
+	RB_DEF_SESS_ATTR(rate_limiter);
 
-	//RB_DEF_SESS_METHOD(channel_flow, 0);
+	RB_DEF_SESS_METHOD(channel_flow, 1); // active
 	//RB_DEF_SESS_METHOD(access_request, 0);
 	RB_DEF_SESS_METHOD(declare_exchange, 6);
 	//RB_DEF_SESS_METHOD(exchange_delete, 0);
@@ -983,7 +5916,7 @@ void Init_rwire()
 	RB_DEF_SESS_METHOD(basic_cancel, 1);
 	RB_DEF_SESS_METHOD(publish_body, 6);
 	RB_DEF_SESS_METHOD(publish_content, 5);
-	//RB_DEF_SESS_METHOD(basic_ack, 0);
+	RB_DEF_SESS_METHOD(basic_ack, 2); // delivery_tag, multiple
 	//RB_DEF_SESS_METHOD(basic_reject, 0);
 	RB_DEF_SESS_METHOD(basic_get, 1);
 
@@ -994,7 +5927,7 @@ void Init_rwire()
 	RB_DEF_SESS_GETTER(exchange);
 	RB_DEF_SESS_GETTER(message_count);
 	//RB_DEF_SESS_GETTER(consumer_count);
-	//RB_DEF_SESS_BOOL_GETTER(active);
+	RB_DEF_SESS_BOOL_GETTER(active);
 	RB_DEF_SESS_GETTER(reply_text);
 	RB_DEF_SESS_GETTER(reply_code);
 	RB_DEF_SESS_GETTER(consumer_tag);
@@ -1002,4 +5935,100 @@ void Init_rwire()
 	//RB_DEF_SESS_GETTER(scope);
 	//RB_DEF_SESS_GETTER(delivery_tag);
 	//RB_DEF_SESS_BOOL_GETTER(redelivered);
+
+// Publisher
+	rb_define_alloc_func(cPublisher, rwire_publisher_alloc);
+	// initialize(session, template, exchange, routing_key, mandatory, immediate)
+	rb_define_method(cPublisher, "initialize", rwire_publisher_init, 6);
+	rb_define_method(cPublisher, "call", rwire_publisher_call, 1); // body
+	RB_DEF_GETTER(cPublisher, rwire_publisher, exchange);
+	RB_DEF_GETTER(cPublisher, rwire_publisher, routing_key);
+
+// Deadline
+	rb_define_alloc_func(cDeadline, rwire_deadline_alloc);
+	rb_define_method(cDeadline, "initialize", rwire_deadline_init, 1); // msecs from now
+	RB_DEF_GETTER(cDeadline, rwire_deadline, remaining);
+	RB_DEF_BOOL_GETTER(cDeadline, rwire_deadline, expired);
+	RB_DEF_GETTER(cDeadline, rwire_deadline, at);
+
+// Capture
+	rb_define_alloc_func(cCapture, rwire_capture_alloc);
+	rb_define_method(cCapture, "initialize", rwire_capture_init, 1); // path
+	rb_define_method(cCapture, "flush", rwire_capture_flush, 0);
+	rb_define_method(cCapture, "close", rwire_capture_close, 0);
+	rb_define_method(cCapture, "record", rwire_capture_record, 4); // kind, content, exchange, routing_key
+	RB_DEF_GETTER(cCapture, rwire_capture, count);
+	RB_DEF_GETTER(cCapture, rwire_capture, bytes);
+
+	rb_define_alloc_func(cCaptureReader, rwire_capture_reader_alloc);
+	rb_define_method(cCaptureReader, "initialize", rwire_capture_reader_init, 1); // path
+	rb_define_method(cCaptureReader, "each", rwire_capture_reader_each, 0);
+	rb_define_method(cCaptureReader, "close", rwire_capture_reader_close, 0);
+	rb_include_module(cCaptureReader, rb_mEnumerable);
+	RB_DEF_GETTER(cCaptureReader, rwire_capture_reader, count);
+	RB_DEF_GETTER(cCaptureReader, rwire_capture_reader, started_at);
+
+// Dispatcher
+	rb_define_alloc_func(cDispatcher, rwire_dispatcher_alloc);
+	rb_define_method(cDispatcher, "initialize", rwire_dispatcher_init, 2); // workers, key
+	rb_define_method(cDispatcher, "pull", rwire_dispatcher_pull, 1);
+	rb_define_method(cDispatcher, "take", rwire_dispatcher_take, 2); // worker, timeout
+	rb_define_method(cDispatcher, "close", rwire_dispatcher_close, 0);
+	rb_define_method(cDispatcher, "start", rwire_dispatcher_start, 1); // handler
+	rb_define_method(cDispatcher, "collect", rwire_dispatcher_collect, 1); // timeout
+	rb_define_singleton_method(cDispatcher, "handlers", rwire_dispatcher_get_handlers, 0);
+	RB_DEF_GETTER(cDispatcher, rwire_dispatcher, size);
+	RB_DEF_GETTER(cDispatcher, rwire_dispatcher, workers);
+	RB_DEF_GETTER(cDispatcher, rwire_dispatcher, dispatched);
+	RB_DEF_GETTER(cDispatcher, rwire_dispatcher, stolen);
+
+// Conflator
+	rb_define_alloc_func(cConflator, rwire_conflator_alloc);
+	rb_define_method(cConflator, "initialize", rwire_conflator_init, 3); // session, key, ack
+	rb_define_method(cConflator, "pull", rwire_conflator_pull, 0);
+	RB_DEF_GETTER(cConflator, rwire_conflator, basic_arrived);
+	RB_DEF_GETTER(cConflator, rwire_conflator, basic_arrived_count);
+	RB_DEF_GETTER(cConflator, rwire_conflator, superseded);
+	rb_define_method(cConflator, "release", rwire_conflator_release, 0);
+
+// Deduplicator
+	rb_define_alloc_func(cDeduplicator, rwire_dedup_alloc);
+	rb_define_method(cDeduplicator, "initialize", rwire_dedup_init, 4); // capacity, window, key, ack
+	rb_define_method(cDeduplicator, "pull", rwire_dedup_pull, 0);
+	rb_define_method(cDeduplicator, "release", rwire_dedup_release, 0);
+	RB_DEF_ATTR(cDeduplicator, rwire_dedup, session);
+	RB_DEF_GETTER(cDeduplicator, rwire_dedup, basic_arrived);
+	RB_DEF_GETTER(cDeduplicator, rwire_dedup, basic_arrived_count);
+	RB_DEF_GETTER(cDeduplicator, rwire_dedup, duplicates);
+	RB_DEF_GETTER(cDeduplicator, rwire_dedup, size);
+	RB_DEF_GETTER(cDeduplicator, rwire_dedup, capacity);
+
+// Prioritizer
+	rb_define_alloc_func(cPrioritizer, rwire_prioritizer_alloc);
+	rb_define_method(cPrioritizer, "initialize", rwire_prioritizer_init, 4); // session, levels, header, fairness
+	rb_define_method(cPrioritizer, "pull", rwire_prioritizer_pull, 0);
+	rb_define_method(cPrioritizer, "release", rwire_prioritizer_release, 0);
+	RB_DEF_GETTER(cPrioritizer, rwire_prioritizer, basic_arrived);
+	RB_DEF_GETTER(cPrioritizer, rwire_prioritizer, basic_arrived_count);
+	RB_DEF_GETTER(cPrioritizer, rwire_prioritizer, sizes);
+	RB_DEF_GETTER(cPrioritizer, rwire_prioritizer, aged);
+
+// RateLimiter
+	rb_define_alloc_func(cRateLimiter, rwire_limiter_alloc);
+	// initialize(messages_per_sec, bytes_per_sec, burst, fail_fast)
+	rb_define_method(cRateLimiter, "initialize", rwire_limiter_init, 4);
+	RB_DEF_GETTER(cRateLimiter, rwire_limiter, throttled_time);
+	RB_DEF_GETTER(cRateLimiter, rwire_limiter, throttled_count);
+	RB_DEF_GETTER(cRateLimiter, rwire_limiter, rejected_count);
+	rb_define_method(cRateLimiter, "acquire", rwire_limiter_acquire_rb, 1); // bytes
+
+// LocalQueue
+	rb_define_alloc_func(cLocalQueue, rwire_local_queue_alloc);
+	rb_define_method(cLocalQueue, "push", rwire_local_queue_push, -1);
+	rb_define_method(cLocalQueue, "shift", rwire_local_queue_shift, 0);
+	rb_define_method(cLocalQueue, "move_to", rwire_local_queue_move_to, 1);
+	rb_define_method(cLocalQueue, "clear", rwire_local_queue_clear, 0);
+	rb_define_method(cLocalQueue, "wait", rwire_local_queue_wait, 1); // timeout
+	rb_define_method(cLocalQueue, "close", rwire_local_queue_close, 0);
+	RB_DEF_GETTER(cLocalQueue, rwire_local_queue, size);
 }